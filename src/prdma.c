@@ -42,7 +42,10 @@
 #ifdef	USE_PRDMA_MSGSTAT
 #define PRDMA_MSGSTAT_SIZE	1024
 #endif	/* USE_PRDMA_MSGSTAT */
-#define PRDMA_SYNC_SIZE	512
+/* 0: FJMPI_Rdma (or its emulation), 1: MPI-3 one-sided */
+#ifndef PRDMA_TRANSPORT_DEFAULT
+#define PRDMA_TRANSPORT_DEFAULT	PRDMA_TRANS_RDMA
+#endif
 
 /* interconnect nic selection */
 /* determine the order of nic usage */
@@ -61,41 +64,72 @@
 #define WPEER	WPEERW
 /* Maximum Transfer Unit (16MB) */
 #define TOFU_MTU	(1 << 24)
-/* fragment put macro */
-#define FJMPI_RDMA_FPUT(PREQ, FLG, RET) \
+/* fragment put/get macros */
+#define FJMPI_RDMA_FPUT(PREQ, FLG, RET)	PRDMA_RDMA_FOP(PREQ, PRDMA_OP_PUT, FLG, RET)
+#define FJMPI_RDMA_FGET(PREQ, FLG, RET)	PRDMA_RDMA_FOP(PREQ, PRDMA_OP_GET, FLG, RET)
+#define PRDMA_RDMA_FOP(PREQ, OP, FLG, RET) \
     { \
 	uint64_t ra = (PREQ)->raddr; \
 	uint64_t la = (PREQ)->lbaddr; \
 	size_t sz = (PREQ)->size; \
-	int mtag; \
 	\
 	RET = 0; \
 	while ((sz >= TOFU_MTU) && (RET == 0)) { \
-	    mtag = _PrdmaTagGet(PREQ); \
-	    RET = FJMPI_Rdma_put((PREQ)->WPEER, mtag, \
-			ra, la, TOFU_MTU >> 1, FLG); \
+	    RET = _PrdmaPut(PREQ, OP, -1, ra, la, TOFU_MTU >> 1, 0, 0, FLG); \
 	    if (RET == 0) { \
 		ra += (TOFU_MTU >> 1); la += (TOFU_MTU >> 1); \
 		sz -= (TOFU_MTU >> 1); \
-		(PREQ)->pend++; \
 	    } \
-	    else { _PrdmaTagFree((PREQ)->fidx, mtag, (PREQ)->WPEER); } \
 	} \
 	if ((sz > 0) && (RET == 0)) { \
-	    mtag = _PrdmaTagGet(PREQ); \
-	    RET = FJMPI_Rdma_put((PREQ)->WPEER, mtag, \
-			ra, la, sz, FLG); \
-	    if (RET == 0) { \
-		/* ra += sz; la += sz; sz -= sz; */ \
-		(PREQ)->pend++; \
-	    } \
-	    else { _PrdmaTagFree((PREQ)->fidx, mtag, (PREQ)->WPEER); } \
+	    RET = _PrdmaPut(PREQ, OP, -1, ra, la, sz, 0, 0, FLG); \
+	    /* ra += sz; la += sz; sz -= sz; */ \
 	} \
     }
-
+/* operations of _PrdmaPut() */
+#define PRDMA_OP_PUT	0
+#define PRDMA_OP_GET	1
+#define PRDMA_OP_PUTF	2	/* put followed by the flag word */
+#define PRDMA_OP_SYNC	3	/* put of a sync word */
+
+#if defined(__linux__) && !defined(PRDMA_NO_SHM)
+#define PRDMA_USE_SHM	/* node-local transport (/dev/shm + CMA) */
+/*
+ * process_vm_writev() copies the iovecs one after another by the
+ * stores of the calling thread, and x86 and SPARC (TSO) make the stores
+ * visible to the other CPUs in that order, so a peer seeing the flag
+ * word of a fused put sees the data before it.  Weaker orders (ARM,
+ * POWER) give no such guarantee and use two puts.
+ */
+#if defined(__x86_64__) || defined(__i386__) || defined(__sparc__)
+#define PRDMA_SHM_PUTF	/* the iovecs of a CMA write are seen in order */
+#endif
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* process_vm_writev() */
+#endif
 #include "prdma.h"
 #include "timesync.h"
 #include "version.h"
+#include <sys/mman.h>
+#if defined(__linux__) && defined(__GLIBC__) && !defined(PRDMA_NO_MEMHOOK)
+#define PRDMA_USE_MEMHOOK	/* munmap/mremap/madvise are interposed */
+#include <dlfcn.h>
+#include <malloc.h>
+#endif
+#if !defined(FJ_MPI) && !defined(PRDMA_USE_SHM)
+#error "prdma needs the Fujitsu RDMA extension or the Linux node-local transport"
+#endif
+#ifdef PRDMA_USE_SHM
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#endif	/* PRDMA_USE_SHM */
 
 #ifdef	USE_PRDMA_MSGSTAT
 typedef struct PrdmaMsgStat {
@@ -115,27 +149,44 @@ int	_prdmaRdmaSize	= PRDMA_SIZE;
 int	_prdmaMTU = 1024*1024;
 int	_prdmaTraceSize = 0;
 int	_prdmaTraceType = 0;
-int	_prdmaSyncSize = PRDMA_SYNC_SIZE;
 int	_prdmaStartTimeout = 0;
+int	_prdmaTransport = PRDMA_TRANSPORT_DEFAULT;
+int	_prdmaHybrid = 1;
+int	_prdmaGetSize = 0;
+int	_prdmaFuse = 1;
+int	_prdmaRnotice = 0;
+int	_prdmaCredit = 1;
+int	_prdmaPlan = 1;
+int	_prdmaSummary = 0;
+int	_prdmaPtracer = 0;
+int	_prdmaMemhook = 0;
+int	_prdmaArenaSize = 8388608;
 
 static MPI_Comm		_prdmaInfoCom;
 static MPI_Comm		_prdmaMemidCom;
-static PrdmaDmaRegion	*_prdmaDmaregs[PRDMA_DMA_HTABSIZE];
-static PrdmaReq		*_prdmaReqTable[PRDMA_REQ_HTABSIZE];
+static PrdmaReq		**_prdmaReqTable;	/* by slot */
+static uint16_t		*_prdmaReqGen;		/* generation of a slot */
+static int		*_prdmaReqFree;		/* free slots */
+static int		_prdmaReqNfree;
+static int		_prdmaReqNslot;		/* size of the table */
+static unsigned int	_prdmaReqEpoch;		/* changed at (un)register */
 static int		_prdmaInitialized = 0;
-static uint16_t		_prdmaRequid;
 static int		_prdmaNumReq;	/* Number of on-the-fly requests */
 static int		_prdmaMemid;
-volatile uint32_t	 *_prdmaSync;	/* this entry is also used
-					 * to pass the remote sync entry */
+static int		_prdmaMemidFree[PRDMA_MEMID_MAX + 1];	/* returned */
+static int		_prdmaMemidNfree;
+PrdmaSyncSeg		_prdmaSyncSeg[PRDMA_SYNC_MAXSEG];
+static int		_prdmaSyncNseg;
+static int		*_prdmaSyncFree;	/* ring of free entries */
+static int		_prdmaSyncFhead, _prdmaSyncFnum;
 static uint32_t		_prdmaSyncConst[PRDMA_SYNC_CNSTSIZE];
-static uint64_t		_prdmaDmaSyncConst;
-static int		_prdmaSyncNumEntry;
-static int		_prdmaMaxSync;
+static uint64_t		_prdmaDmaSyncConst[PRDMA_TRANS_NSLOT];
 static int		_prdmaNprocs;
 static int		_prdmaMyrank;
-uint64_t		_prdmaDmaThisSync;
-volatile uint64_t	*_prdmaRdmaSync;
+static MPI_Comm		_prdmaNodeCom;	/* ranks sharing this node */
+static int		*_prdmaNodeRank; /* world rank -> node rank or -1 */
+static PrdmaTrans	*_prdmaTransTab[PRDMA_TRANS_NSLOT]; /* by slot */
+static int		_prdmaTransNum;
 #ifdef	USE_PRDMA_MSGSTAT
 static PrdmaMsgStat	_prdmaSendstat[PRDMA_MSGSTAT_SIZE];
 static PrdmaMsgStat	_prdmaRecvstat[PRDMA_MSGSTAT_SIZE];
@@ -144,18 +195,27 @@ static uint64_t		_prdma_sl, _prdma_sr, _prdma_el, _prdma_er;
 static uint64_t		_prdma_to_tsc = 0; /* timeout time stamp counter */
 /*
  * dummy MPI_Request structure for MPI_Request_f2c()
+ * One for each slot of the request table.  The address range is
+ * reserved for all the slots at once so that it can be told from the
+ * MPI_Request of the MPI library, and a page is backed by memory when
+ * MPI_Request_f2c() first writes to it.
  */
 struct dummy_mreq {
      uint64_t	ul[16]; /* 128 Bytes */
 };
-#define DUMMY_REQUEST_COUNT	2048
-#define PRDMA_F_TO_C_OFFSET	(1000 * 1000 * 1000)
-static struct dummy_mreq	_prdma_mreqs[DUMMY_REQUEST_COUNT];
+#define DUMMY_REQUEST_COUNT	PRDMA_REQ_MAXSLOT
+#define PRDMA_F_TO_C_OFFSET	(1 << PRDMA_REQ_IDBITS)
+static struct dummy_mreq	*_prdma_mreqs;
 
 #define PRDMA_NIC_NPAT	4
 static int _prdmaNICID[PRDMA_NIC_NPAT] = {
      FJMPI_RDMA_NIC0,FJMPI_RDMA_NIC1,FJMPI_RDMA_NIC2,FJMPI_RDMA_NIC3
 };
+#define PRDMA_CQ_BATCH	16	/* completions of a queue in a poll */
+#define PRDMA_CQ_IDLE	16	/* polls between looks at an idle nic */
+/* operations issued on a nic of a transport and not noticed yet */
+static int		_prdmaCQout[PRDMA_TRANS_NSLOT][PRDMA_NIC_NPAT];
+static unsigned int	_prdmaCQcall;
 static PrdmaReq	*_PrdmaCQpoll();
 static void	_PrdmaNICinit(void);
 static void	_PrdmaSynMBLinit(void);
@@ -164,6 +224,25 @@ static void	_PrdmaChangeState_wrapped(PrdmaReq *preq,
 #define _PrdmaChangeState(PREQ, NSTA, NSUB) \
 		_PrdmaChangeState_wrapped(PREQ, NSTA, NSUB, __LINE__)
 static void	_PrdmaTrcinit(void);
+static void	_PrdmaTransinit(void);
+static PrdmaTrans	*_PrdmaPeerTrans(int WPEER);
+static int	_PrdmaGetRecv(PrdmaReq *preq);
+static void	_PrdmaCreditFree(PrdmaReq *preq);
+static int	_PrdmaCreditReturn(PrdmaReq *preq);
+static void	_PrdmaNegotiated(PrdmaReq *preq);
+static int	_Prdma_Syn_waitp(int nreq, MPI_Request *reqs,
+				 PrdmaReq **preqs);
+static int	_PrdmaRegionEvict(void);
+static void	_PrdmaReleaseRegion(int memid);
+#ifdef PRDMA_USE_SHM
+static PrdmaTrans	_prdmaTransShm;
+static PrdmaTrans	_prdmaTransSim;
+#endif	/* PRDMA_USE_SHM */
+#ifdef PRDMA_SHM_PUTF
+static int	_PrdmaShmPutf(int pid, int tag, uint64_t raddr, uint64_t laddr,
+			      size_t size, uint64_t fraddr, uint64_t fladdr,
+			      int flag);
+#endif	/* PRDMA_SHM_PUTF */
 
 void
 _PrdmaPrintf(FILE *fp, const char *fmt, ...)
@@ -205,7 +284,8 @@ _prdmaErrorExit(int type)
 	_PrdmaPrintf(stderr, "No more space for request structuret\n");
 	break;
     case 2:
-	_PrdmaPrintf(stderr, "No more space for synchronization entry\n");
+	_PrdmaPrintf(stderr, "No more space for synchronization entry "
+		     "(%d segments)\n", _prdmaSyncNseg);
 	break;
     case 3:
 	_PrdmaPrintf(stderr, "RDMA communication error\n");
@@ -214,12 +294,76 @@ _prdmaErrorExit(int type)
 	_PrdmaPrintf(stderr, "No more space for ReserveRegion Management\n");
 	break;
     case 11:
-	_PrdmaPrintf(stderr, "No more space for ReserveRegion Management\n");
+	_PrdmaPrintf(stderr, "No more memid for ReserveRegion, "
+		     "all the regions are in use\n");
+	break;
     default:
 	_PrdmaPrintf(stderr, "Internal Error\n");
     }
     MPI_Abort(MPI_COMM_WORLD, -type);
 }
+
+/*
+ * ranks sharing this node
+ *   Without MPI_Comm_split_type() of MPI-3, the ranks are split by
+ *   their processor name.
+ */
+static void
+_PrdmaNodeInit(void)
+{
+    int		nsize, i;
+    int		*wranks;
+
+#if defined(MPI_VERSION) && (MPI_VERSION >= 3)
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+			MPI_INFO_NULL, &_prdmaNodeCom);
+#else
+    {
+	char		name[MPI_MAX_PROCESSOR_NAME], *names;
+	unsigned int	hash;
+	int		len, color;
+	MPI_Comm	hcom;
+
+	memset(name, 0, sizeof(name));
+	MPI_Get_processor_name(name, &len);
+	for (hash = 5381, i = 0; i < len; i++) {
+	    hash = hash*33 + (unsigned char) name[i];
+	}
+	MPI_Comm_split(MPI_COMM_WORLD, hash & 0x7fffffff, _prdmaMyrank, &hcom);
+	/* names of the same hash value */
+	MPI_Comm_size(hcom, &nsize);
+	names = malloc(MPI_MAX_PROCESSOR_NAME*nsize);
+	if (names == NULL) {
+	    _prdmaErrorExit(10);
+	    return;
+	}
+	MPI_Allgather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
+		      names, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, hcom);
+	for (color = 0; color < nsize; color++) {
+	    if (!strcmp(&names[MPI_MAX_PROCESSOR_NAME*color], name)) break;
+	}
+	free(names);
+	MPI_Comm_split(hcom, color, _prdmaMyrank, &_prdmaNodeCom);
+	MPI_Comm_free(&hcom);
+    }
+#endif	/* MPI_VERSION >= 3 */
+    MPI_Comm_size(_prdmaNodeCom, &nsize);
+    _prdmaNodeRank = malloc(sizeof(int)*_prdmaNprocs);
+    wranks = malloc(sizeof(int)*nsize);
+    if (_prdmaNodeRank == NULL || wranks == NULL) {
+	_prdmaErrorExit(10);
+	return;
+    }
+    MPI_Allgather(&_prdmaMyrank, 1, MPI_INT, wranks, 1, MPI_INT,
+		  _prdmaNodeCom);
+    for (i = 0; i < _prdmaNprocs; i++) {
+	_prdmaNodeRank[i] = -1;
+    }
+    for (i = 0; i < nsize; i++) {
+	_prdmaNodeRank[wranks[i]] = i;
+    }
+    free(wranks);
+}
 #ifdef	USE_PRDMA_MSGSTAT
 
 static void
@@ -251,149 +395,311 @@ _PrdmaStatMessage(PrdmaReq *top)
 }
 #endif	/* USE_PRDMA_MSGSTAT */
 
-static int	_PrdmaTagGet(PrdmaReq *pr);
+static int	_PrdmaPut(PrdmaReq *preq, int op, int tag,
+			  uint64_t raddr, uint64_t laddr, size_t size,
+			  uint64_t sraddr, uint64_t sladdr, int flag);
 static void	_PrdmaTagFree(int nic, int tag /* ent */, int pid);
+static int	_PrdmaTagRelease(int nic, int tag /* ent */, int pid);
+static void	_PrdmaPutQDrain(int slot, int nic);
 static PrdmaReq	*_PrdmaTag2Req(int nic, int tag /* ent */, int pid);
 static void	_PrdmaTagInit(void);
+static int	_PrdmaTagSlot(int pid);
+static int	_PrdmaRnTagGet(PrdmaReq *pr);
+static void	_PrdmaRnTagFree(PrdmaReq *pr);
+static PrdmaReq	*_PrdmaRnTag2Req(int nic, int tag, int pid);
+static int	_prdmaTagNum;	/* tags of _PrdmaTagTake() */
 
 static int
 _PrdmaGetmemid()
 {
-    ++_prdmaMemid;
-    if (_prdmaMemid > PRDMA_MEMID_MAX) {
-	/* no more memid is allocated */
-	return -1;
+    if (_prdmaMemidNfree > 0) {
+	return _prdmaMemidFree[--_prdmaMemidNfree];
+    }
+    if (_prdmaMemid < PRDMA_MEMID_MAX) {
+	return ++_prdmaMemid;
     }
-    return _prdmaMemid;
+    /* a cached region gives its memid up */
+    if (_PrdmaRegionEvict() == 0) {
+	return _prdmaMemidFree[--_prdmaMemidNfree];
+    }
+    /* no more memid is allocated */
+    return -1;
 }
 
-static int
-_PrdmaReqHashKey(uint32_t key)
+static void
+_PrdmaPutmemid(int memid)
 {
-    key = key & (PRDMA_REQ_HTABSIZE - 1);
-    return key;
+    _prdmaMemidFree[_prdmaMemidNfree++] = memid;
 }
 
-static int
-_PrdmaAddrHashKey(void *addr)
+/*
+ * DMA address of the receiver's buffer in the sender.  The address of
+ * this trunk has come with struct recvinfo if the transport allows it,
+ * or it is at the offset in the region of the memid.
+ */
+static uint64_t
+_PrdmaRemoteBuf(PrdmaReq *preq)
 {
-    int	key = ((uint64_t)(unsigned long)addr >> 4) & 0xffffffff;
-    key = key & (PRDMA_DMA_HTABSIZE - 1);
-    return key;
+    if (preq->trans->flags & PRDMA_TRANS_F_RADDR) {
+	return preq->rbaddr;
+    }
+    return (*preq->trans->raddr)(preq->WPEER, preq->rbid) + preq->rboff;
 }
 
-static void
-_PrdmaCheckRdmaSync(int WPEER)
+/*
+ * Synchronization area
+ *	The sync entries (_prdmaSync[] in the figures above) are held in
+ *	segments of PRDMA_SYNC_SEGSIZE entries.  A segment is registered
+ *	with its own memid when all the entries are in use, the first one
+ *	with PRDMA_MEMID_SYNC.  An entry is addressed by its index, the
+ *	segment in the upper bits, and the peer is told the memid of the
+ *	segment with it.  The free entries are kept in a ring, so that an
+ *	entry is reused as late as possible.
+ *	An entry has a cache line of its own, so that the writes of the
+ *	peers to an entry do not disturb the polling of the others, unless
+ *	PRDMA_SYNC_STRIDE is defined 1 at compile time.  The first lines
+ *	of the first segment are the summary, a word of a group in each
+ *	line: a sender puts SYNC_MARKER into the word of the group of the
+ *	receiver's entry as well (PRDMA_SUMMARY), and MPI_Waitall looks at
+ *	the requests of the groups found there only.
+ */
+static int
+_PrdmaSyncGrow()
 {
-    if (_prdmaRdmaSync[WPEER] == 0) {
-	_prdmaRdmaSync[WPEER]
-	    = FJMPI_Rdma_get_remote_addr(WPEER,PRDMA_MEMID_SYNC);
+    PrdmaSyncSeg	*pss;
+    void		*vp;
+    int			*fp;
+    int			size, i;
+
+    if (_prdmaSyncNseg == PRDMA_SYNC_MAXSEG) {
+	return -1;
+    }
+    pss = &_prdmaSyncSeg[_prdmaSyncNseg];
+    size = sizeof(uint32_t)*PRDMA_SYNC_STRIDE*PRDMA_SYNC_SEGSIZE;
+    fp = realloc(_prdmaSyncFree,
+		 sizeof(int)*PRDMA_SYNC_SEGSIZE*(_prdmaSyncNseg + 1));
+    if (posix_memalign(&vp, PRDMA_SYNC_LINE, size) != 0
+	|| fp == NULL) {
+	_prdmaErrorExit(10);
+	return -1; /* never return */
+    }
+    pss->ent = vp;
+    _prdmaSyncFree = fp;
+    memset((void*) pss->ent, PRDMA_SYNC_NOTUSED, size);
+    pss->memid = (_prdmaSyncNseg == 0) ? PRDMA_MEMID_SYNC : _PrdmaGetmemid();
+    if (pss->memid < 0) {
+	free((void*) pss->ent);
+	return -1;
+    }
+    for (i = 0; i < _prdmaTransNum; i++) {
+	pss->dmaaddr[i] = (*_prdmaTransTab[i]->regmem)(pss->memid,
+						       (void*) pss->ent, size);
+	if (pss->dmaaddr[i] == FJMPI_RDMA_ERROR) {
+	    _PrdmaPrintf(stderr, "%s: reg_mem failed\n",
+			 _prdmaTransTab[i]->name);
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	    return -1;
+	}
+    }
+    /* the ring is empty, and the first lines are the summary */
+    _prdmaSyncFnum = 0;
+    for (i = (_prdmaSyncNseg == 0) ? PRDMA_SUMMARY_ENT(PRDMA_SUMMARY_NGRP)
+	     : 0; i < PRDMA_SYNC_SEGSIZE; i++) {
+	_prdmaSyncFree[_prdmaSyncFnum++]
+	    = (_prdmaSyncNseg << PRDMA_SYNC_SEGBITS) + i;
     }
+    _prdmaSyncFhead = 0;
+    _prdmaSyncNseg++;
+    return 0;
 }
 
 static int
 _PrdmaSyncGetEntry()
 {
-    static int	hint = 0;
     int		idx;
 
-    /* _prdmaSyncNumEntry is updated if more room is found */
-    if (_prdmaSyncNumEntry >= _prdmaMaxSync) {
+    if (_prdmaSyncFnum == 0 && _PrdmaSyncGrow() < 0) {
 	/* No more synchronization structure can be allocated */
 	_prdmaErrorExit(2);
 	return -1;
     }
-    idx = hint;
-    while (_prdmaSync[idx] != PRDMA_SYNC_NOTUSED) {
-	idx = PRDMA_ROUND_INC(idx, _prdmaMaxSync);
+    idx = _prdmaSyncFree[_prdmaSyncFhead];
+    if (++_prdmaSyncFhead == _prdmaSyncNseg*PRDMA_SYNC_SEGSIZE) {
+	_prdmaSyncFhead = 0;
     }
-    _prdmaSync[idx] = PRDMA_SYNC_USED;
-    _prdmaSyncNumEntry++;
-    hint = PRDMA_ROUND_INC(idx, _prdmaMaxSync);
+    _prdmaSyncFnum--;
+    PRDMA_SYNC_ENTRY(idx) = PRDMA_SYNC_USED;
     return idx;
 }
 
 static void
 _PrdmaSyncFreeEntry(int ent)
 {
-    _prdmaSync[ent] = PRDMA_SYNC_NOTUSED;
-    --_prdmaSyncNumEntry;
+    int		tail;
+
+    PRDMA_SYNC_ENTRY(ent) = PRDMA_SYNC_NOTUSED;
+    tail = _prdmaSyncFhead + _prdmaSyncFnum;
+    if (tail >= _prdmaSyncNseg*PRDMA_SYNC_SEGSIZE) {
+	tail -= _prdmaSyncNseg*PRDMA_SYNC_SEGSIZE;
+    }
+    _prdmaSyncFree[tail] = ent;
+    _prdmaSyncFnum++;
+}
+
+/* the count in the sync entry has reached n */
+static int
+_PrdmaSyncReached(uint32_t val, unsigned int n)
+{
+    return ((val - n) & PRDMA_SYNC_IDXMASK) <= (PRDMA_SYNC_IDXMASK >> 1);
+}
+
+
+/*
+ * The request table is extended to nslot slots.  Only called when no
+ * slot is free.
+ */
+static int
+_PrdmaReqGrow(int nslot)
+{
+    PrdmaReq	**tab;
+    uint16_t	*gen;
+    int		*fre;
+    int		slot;
+
+    if (nslot > PRDMA_REQ_MAXSLOT) {
+	return -1;
+    }
+    tab = realloc(_prdmaReqTable, sizeof(PrdmaReq*)*nslot);
+    if (tab == NULL) return -1;
+    _prdmaReqTable = tab;
+    gen = realloc(_prdmaReqGen, sizeof(uint16_t)*nslot);
+    if (gen == NULL) return -1;
+    _prdmaReqGen = gen;
+    fre = realloc(_prdmaReqFree, sizeof(int)*nslot);
+    if (fre == NULL) return -1;
+    _prdmaReqFree = fre;
+    /* the lowest new slot is taken first */
+    for (slot = nslot - 1; slot >= _prdmaReqNslot; slot--) {
+	_prdmaReqTable[slot] = NULL;
+	_prdmaReqGen[slot] = 1;
+	_prdmaReqFree[_prdmaReqNfree++] = slot;
+    }
+    _prdmaReqNslot = nslot;
+    return 0;
 }
 
+static void
+_PrdmaReqInit(void)
+{
+    _prdmaReqNslot = 0;
+    _prdmaReqNfree = 0;
+    _prdmaNumReq = 0;
+    if (_PrdmaReqGrow(PRDMA_REQ_INITSLOT) != 0) {
+	_prdmaErrorExit(1);
+    }
+    _prdma_mreqs = mmap(NULL, sizeof(struct dummy_mreq)*DUMMY_REQUEST_COUNT,
+			PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (_prdma_mreqs == MAP_FAILED) {
+	_prdma_mreqs = NULL;
+	_prdmaErrorExit(1);
+    }
+}
 
 static int
 _PrdmaReqRegister(PrdmaReq *pr)
 {
-    uint16_t	uid;
-    int		key;
-    PrdmaReq	*pq, *opq;
+    int		slot;
 
-    if (_prdmaNumReq > PRDMA_REQ_MAXREQ) {
+    if (_prdmaReqNfree == 0
+	&& _PrdmaReqGrow(_prdmaReqNslot*2) != 0) {
 	_prdmaErrorExit(1);
 	return -1;
     }
-retry:
-    PRDMA_REQUID_INC;
-    uid = _prdmaRequid;
-    key = _PrdmaReqHashKey(uid);
-    pq = _prdmaReqTable[key];
-    if (pq == NULL) {
-	_prdmaReqTable[key] = pr;
-    } else {
-	/* checking if the uid is stil used */
-	for (opq = pq; pq != NULL; opq = pq, pq = pq->next) {
-	    if (pq->uid == uid) {
-		/* still the uid has been used */
-		goto retry;
-	    }
-	}
-	opq->next = pr;
-    }
-    pr->uid = uid;
-    pr->next = 0;
-    return uid;
+    slot = _prdmaReqFree[--_prdmaReqNfree];
+    _prdmaReqTable[slot] = pr;
+    ++_prdmaNumReq;
+    ++_prdmaReqEpoch;
+    pr->uid = PRDMA_REQ_HANDLE(slot, _prdmaReqGen[slot]);
+    return pr->uid;
 }
 
 static void
 _PrdmaReqUnregister(PrdmaReq *req)
 {
-    uint16_t	uid;
-    int		key;
-    PrdmaReq	*pq, *opq;
+    int		slot;
 
-    uid = req->uid;
-    key = _PrdmaReqHashKey(uid);
-    pq = _prdmaReqTable[key];
-    if (pq == NULL) {
+    slot = PRDMA_REQ_SLOT(req->uid);
+    if (_prdmaReqTable[slot] != req) {
 	/* internal error !!! */
-	/* have to handle this error  */
 	return;
     }
-    for (opq = pq; pq != NULL; opq = pq, pq = pq->next) {
-	if (pq->uid == uid) goto find;
-    }
-    /* internal error !!! */
-    return;
-find:
-    if (pq == _prdmaReqTable[key]) {
-	_prdmaReqTable[key] = NULL;
-    } else {
-	opq->next = pq->next;
+    _prdmaReqTable[slot] = NULL;
+    /* the handles of this slot given so far are no longer valid */
+    if (++_prdmaReqGen[slot] > PRDMA_REQ_GENMAX) {
+	_prdmaReqGen[slot] = 1;
     }
-    /* decrement ing the number of uids */
+    _prdmaReqFree[_prdmaReqNfree++] = slot;
     --_prdmaNumReq;
+    ++_prdmaReqEpoch;
 }
 
-static PrdmaReq	*
-_PrdmaReqAlloc(PrdmaRtype type)
+/*
+ * A request and its trunks are allocated as one block of n request
+ * structures, each on its own cache lines, so that the trunks are
+ * walked in sequential memory.  Blocks of up to PRDMA_SLAB_MAXN
+ * structures are carved from slabs and kept on a free list for each n,
+ * which is linked through ->trunks, when MPI_Request_free() is called.
+ */
+static PrdmaReq		*_prdmaReqSlab[PRDMA_SLAB_MAXN + 1];
+
+static PrdmaReq *
+_PrdmaReqBlockAlloc(int n)
 {
-    PrdmaReq	*pq;
+    PrdmaReq	*blk;
+    char	*slab;
+    size_t	bsize = PRDMA_REQ_SIZE*n;
+    int		nblk, i;
+
+    if (n > PRDMA_SLAB_MAXN) {
+	if (posix_memalign((void**) &blk, PRDMA_CACHELINE, bsize) != 0) {
+	    _prdmaErrorExit(1);
+	    return 0; /* never here */
+	}
+	return blk;
+    }
+    if (_prdmaReqSlab[n] == NULL) {
+	nblk = PRDMA_SLAB_NREQ/n;
+	if (posix_memalign((void**) &slab, PRDMA_CACHELINE, bsize*nblk) != 0) {
+	    _prdmaErrorExit(1);
+	    return 0; /* never here */
+	}
+	/* the first block of the slab is taken first */
+	for (i = nblk - 1; i >= 0; i--) {
+	    blk = (PrdmaReq*) (slab + bsize*i);
+	    blk->trunks = _prdmaReqSlab[n];
+	    _prdmaReqSlab[n] = blk;
+	}
+    }
+    blk = _prdmaReqSlab[n];
+    _prdmaReqSlab[n] = blk->trunks;
+    return blk;
+}
 
-    pq = malloc(sizeof(PrdmaReq));
-    if (pq == 0) {
-	_prdmaErrorExit(1);
-	return 0; /* never here */
+static void
+_PrdmaReqBlockFree(PrdmaReq *blk, int n)
+{
+    if (n > PRDMA_SLAB_MAXN) {
+	free(blk);
+	return;
     }
+    blk->trunks = _prdmaReqSlab[n];
+    _prdmaReqSlab[n] = blk;
+}
+
+static PrdmaReq	*
+_PrdmaReqAlloc(PrdmaReq *pq, PrdmaRtype type)
+{
     memset(pq, 0, sizeof(PrdmaReq));
     pq->type = type;
     _PrdmaChangeState(pq, PRDMA_RSTATE_INIT, -1);
@@ -405,29 +711,39 @@ static void
 _PrdmaReqfree(PrdmaReq *top)
 {
     PrdmaReq	*pq, *npq;
+    int		n = 0;
 
-    for (pq = top; pq != NULL; pq = npq) {
+    for (pq = top; pq != NULL; pq = npq, n++) {
+	while (pq->pend > 0) {
+	    /*
+	     * The notices of its operations, queued or issued, e.g., the
+	     * last credit being returned, must not find a reused request.
+	     */
+	    _PrdmaCQpoll();
+	}
 	_PrdmaReqUnregister(pq);
 	_PrdmaSyncFreeEntry(pq->lsync);
+	_PrdmaRnTagFree(pq);
+	_PrdmaCreditFree(pq);
 	npq = pq->trunks;
 	if (_prdma_trc_rlog != NULL) {
 	    (*_prdma_trc_rlog)(pq, PRDMA_RSTATE_UNKNOWN, 1, __LINE__);
 	}
-	free(pq);
     }
+    /* the trunks share the region of the top */
+    _PrdmaReleaseRegion(top->lbid);
+    _PrdmaReqBlockFree(top, n);
 }
 
 static PrdmaReq *
 _PrdmaReqFind(uint64_t id)
 {
-    int		key;
-    uint16_t	uid;
     PrdmaReq	*pq;
 
     /* This is only applicable for OpenMPI */
-    if (id > 0xffff) { /* Original Request ID */
-	if (
-	    ((struct dummy_mreq *)id >= &_prdma_mreqs[0])
+    if (!PRDMA_REQ_ISHANDLE(id)) { /* Original Request ID */
+	if (_prdma_mreqs != NULL
+	    && ((struct dummy_mreq *)id >= &_prdma_mreqs[0])
 	    && ((struct dummy_mreq *)id < &_prdma_mreqs[DUMMY_REQUEST_COUNT])
 	) {
 	    int *c_req = (int *)id;
@@ -445,213 +761,669 @@ _PrdmaReqFind(uint64_t id)
 	    return NULL;
 	}
     }
-    uid = id;
-    key = _PrdmaReqHashKey(uid);
-    pq = _prdmaReqTable[key];
-    while (pq) {
-	if (pq->uid == uid) {
-	    return pq;
-	}
-	pq = pq->next;
+    if (PRDMA_REQ_SLOT(id) >= _prdmaReqNslot) {
+	return NULL;
+    }
+    pq = _prdmaReqTable[PRDMA_REQ_SLOT(id)];
+    if (pq != NULL && pq->uid == id) {
+	return pq;
     }
     return NULL;
 }
 
 
-static int
-_PrdmaReserveRegion(uint64_t *dmaaddr, void *addr, int size)
+/*
+ * Registration cache
+ *	A region registered to all the transports is found for any part
+ *	of it.  A new region covers the regions it overlaps, as long as it
+ *	is not larger than PRDMA_DMA_MAXSIZE, and those are taken out of
+ *	the cache.  A region is referenced by the persistent requests on
+ *	it.  An unreferenced region is kept in the cache until its memid
+ *	is needed, and the least recently used one is deregistered first.
+ *	A region taken out of the cache is deregistered when its last
+ *	request is freed.
+ *	Unless PRDMA_MEMHOOK keeps malloc() from unmapping the memory it
+ *	frees, which glibc does unseen by the memory hooks, a region is
+ *	deregistered as soon as it has no request, so that memory mapped
+ *	again at the same address never finds a stale registration.
+ */
+#ifdef PRDMA_USE_MEMHOOK
+#define PRDMA_DMA_KEEP	(_prdmaMemhook != 0)	/* unreferenced regions */
+#else
+#define PRDMA_DMA_KEEP	0
+#endif	/* PRDMA_USE_MEMHOOK */
+
+static PrdmaDmaRegion	*_prdmaDmaLru;	/* cache, the most recent first */
+static PrdmaDmaRegion	*_prdmaDmaById[PRDMA_MEMID_MAX + 1];
+static char		*_prdmaDmaLo, *_prdmaDmaHi;	/* of the cache */
+
+static void
+_PrdmaRegionUnlink(PrdmaDmaRegion *pdr)
 {
-    PrdmaDmaRegion	*pdr;
-    int			key;
-    int			ent;
-    int			memid;
+    if (pdr->prev) pdr->prev->next = pdr->next;
+    else _prdmaDmaLru = pdr->next;
+    if (pdr->next) pdr->next->prev = pdr->prev;
+    pdr->next = pdr->prev = NULL;
+    pdr->cached = 0;
+}
 
-    ent = key = _PrdmaAddrHashKey(addr);
-    do {
-	pdr = _prdmaDmaregs[ent];
-	if (pdr == 0) goto newent;
-	if (pdr->start == addr) {
-	    if (size <= pdr->size) {
-		goto find;
-	    } else { /* Must be enlarged */
-		_PrdmaPrintf(stderr, "_PrdmaReserveRegion: Enlarging\n");
-		goto newent;
-	    }
-	}
-	ent = PRDMA_ROUND_INC(ent, PRDMA_DMA_HTABSIZE);
-    } while (ent != key);
-    /* runnout: no more region can be allocated */
-    _prdmaErrorExit(11);
-    return -1; /* never return */
-newent:
-    pdr = (PrdmaDmaRegion*) malloc(sizeof(PrdmaDmaRegion));
-    if (pdr == NULL) {
-	_prdmaErrorExit(10);
-	return -1; /* never return */
-    }
-    if (_prdmaDmaregs[ent]) { /* old entry is pushed */
-	pdr->next = _prdmaDmaregs[ent];
-	_prdmaDmaregs[ent] = pdr;
+static void
+_PrdmaRegionLink(PrdmaDmaRegion *pdr)
+{
+    pdr->prev = NULL;
+    pdr->next = _prdmaDmaLru;
+    if (_prdmaDmaLru) _prdmaDmaLru->prev = pdr;
+    _prdmaDmaLru = pdr;
+    pdr->cached = 1;
+    /* bounds of the cache for the memory hooks */
+    if (_prdmaDmaLo == NULL || (char*) pdr->start < _prdmaDmaLo) {
+	_prdmaDmaLo = pdr->start;
     }
-    memid = _PrdmaGetmemid();
-    pdr->start = addr;
-    pdr->memid = memid;
-    pdr->size = size;
-    pdr->dmaaddr = FJMPI_Rdma_reg_mem(memid, (char *)addr, size);
-    if (pdr->dmaaddr == FJMPI_RDMA_ERROR) {
-	_PrdmaPrintf(stderr, "FJMPI_Rdma_reg_mem failed\n");
-	MPI_Abort(MPI_COMM_WORLD, -1);
-	return -1;
+    if ((char*) pdr->start + pdr->size > _prdmaDmaHi) {
+	_prdmaDmaHi = (char*) pdr->start + pdr->size;
     }
-find:
-    *dmaaddr = pdr->dmaaddr;
-    return pdr->memid;
 }
 
-int
-PrdmaReserveRegion(void *addr, int size)
+static void
+_PrdmaRegionDrop(PrdmaDmaRegion *pdr)
 {
-    int         lbid;
-    uint64_t    lbaddr;
+    int		i;
 
-    lbid = _PrdmaReserveRegion(&lbaddr, addr, size);
-    return lbid;
+    if (pdr->cached) {
+	_PrdmaRegionUnlink(pdr);
+    }
+    for (i = 0; i < _prdmaTransNum; i++) {
+	(*_prdmaTransTab[i]->deregmem)(pdr->memid);
+    }
+    _prdmaDmaById[pdr->memid] = NULL;
+    _PrdmaPutmemid(pdr->memid);
+    free(pdr);
 }
 
-struct PrdmaOptions {
-    char	*sym;
-    int		*var;
-};
+/* the least recently used region without a request is deregistered */
+static int
+_PrdmaRegionEvict(void)
+{
+    PrdmaDmaRegion	*pdr, *vic = NULL;
 
-static struct PrdmaOptions _poptions[] = {
-    { "PRDMA_DEBUG", &_prdmaDebug },
-    { "PRDMA_NOSYNC", &_prdmaNosync },
-    { "PRDMA_NOTRUNK", &_prdmaNoTrunk },
-    { "PRDMA_VERBOSE", &_prdmaVerbose },
-    { "PRDMA_STATISTIC", &_prdmaStat },
-    { "PRDMA_RDMASIZE", &_prdmaRdmaSize },
-    { "PRDMA_SYNCSIZE", &_prdmaSyncSize },
-    { "PRDMA_TRACESIZE", &_prdmaTraceSize },
-    { "PRDMA_TRACETYPE", &_prdmaTraceType },
-    { "PRDMA_STARTTOUT", &_prdmaStartTimeout },
-    { 0, 0 }
-};
+    for (pdr = _prdmaDmaLru; pdr != NULL; pdr = pdr->next) {
+	if (pdr->ref == 0) vic = pdr;
+    }
+    if (vic == NULL) {
+	return -1;
+    }
+    _PrdmaRegionDrop(vic);
+    return 0;
+}
 
+/* a request on the region has been freed */
 static void
-_PrdmaOptions()
+_PrdmaReleaseRegion(int memid)
 {
-    struct PrdmaOptions	*po;
-    char		*cp;
+    PrdmaDmaRegion	*pdr;
 
-    for (po = _poptions; po->sym; po++) {
-	cp = getenv(po->sym);
-	if (cp) {
-	    *po->var = atoi(cp);
+    if (memid < 0 || memid > PRDMA_MEMID_MAX
+	|| (pdr = _prdmaDmaById[memid]) == NULL) {
+	return;
+    }
+    if (--pdr->ref == 0 && (!pdr->cached || !PRDMA_DMA_KEEP)) {
+	_PrdmaRegionDrop(pdr);
+    }
+}
+
+/* offset in its region of the local buffer of a request */
+static uint64_t
+_PrdmaRegionOffset(PrdmaReq *preq)
+{
+    PrdmaDmaRegion	*pdr = _prdmaDmaById[preq->lbid];
+
+    return preq->lbaddr - pdr->dmaaddr[preq->trans->slot];
+}
+
+/*
+ * A region is registered to all the transports, and the DMA address
+ * of the given transport is returned.
+ */
+static int
+_PrdmaReserveRegion(PrdmaTrans *trans, uint64_t *dmaaddr, void *addr, int size)
+{
+    PrdmaDmaRegion	*pdr, *opdr, *npdr;
+    char		*lo, *hi, *nlo, *nhi;
+    int			memid;
+    int			i, more;
+
+    lo = addr;
+    hi = lo + size;
+    for (pdr = _prdmaDmaLru; pdr != NULL; pdr = pdr->next) {
+	if ((char*) pdr->start <= lo
+	    && hi <= (char*) pdr->start + pdr->size) {
+	    goto find;
 	}
     }
-    if (_prdmaVerbose && _prdmaMyrank == 0) {
-	_PrdmaPrintf(stderr, "Version prdma-%s\n", PRDMA_VERSION_STRING);
-	for (po = _poptions; po->sym; po++) {
-	    if (*po->var) {
-		_PrdmaPrintf(stderr, "%s is %d\n", po->sym, *po->var);
+    /* the overlapping regions are merged */
+    do {
+	more = 0;
+	for (pdr = _prdmaDmaLru; pdr != NULL; pdr = pdr->next) {
+	    nlo = (char*) pdr->start;
+	    nhi = nlo + pdr->size;
+	    if (nhi <= lo || hi <= nlo || (lo <= nlo && nhi <= hi)) {
+		continue;
+	    }
+	    if (nlo > lo) nlo = lo;
+	    if (nhi < hi) nhi = hi;
+	    if (nhi - nlo > PRDMA_DMA_MAXSIZE) {
+		continue;
+	    }
+	    lo = nlo; hi = nhi;
+	    more = 1;
+	}
+    } while (more);
+    memid = _PrdmaGetmemid();
+    if (memid < 0) {
+	/* runnout: no more region can be allocated */
+	_prdmaErrorExit(11);
+	return -1; /* never return */
+    }
+    pdr = (PrdmaDmaRegion*) malloc(sizeof(PrdmaDmaRegion));
+    if (pdr == NULL) {
+	_prdmaErrorExit(10);
+	return -1; /* never return */
+    }
+    memset(pdr, 0, sizeof(PrdmaDmaRegion));
+    pdr->start = lo;
+    pdr->memid = memid;
+    pdr->size = hi - lo;
+    for (i = 0; i < _prdmaTransNum; i++) {
+	pdr->dmaaddr[i] = (*_prdmaTransTab[i]->regmem)(memid, lo, hi - lo);
+	if (pdr->dmaaddr[i] == FJMPI_RDMA_ERROR) {
+	    _PrdmaPrintf(stderr, "%s: reg_mem failed\n",
+			 _prdmaTransTab[i]->name);
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	    return -1;
+	}
+    }
+    /* the merged regions leave the cache */
+    for (opdr = _prdmaDmaLru; opdr != NULL; opdr = npdr) {
+	npdr = opdr->next;
+	if ((char*) opdr->start >= lo
+	    && (char*) opdr->start + opdr->size <= hi) {
+	    if (opdr->ref == 0) {
+		_PrdmaRegionDrop(opdr);
 	    } else {
-		_PrdmaPrintf(stderr, "%s is OFF\n", po->sym);
+		_PrdmaRegionUnlink(opdr);
 	    }
 	}
     }
+    _prdmaDmaById[memid] = pdr;
+    _PrdmaRegionLink(pdr);
+find:
+    if (pdr != _prdmaDmaLru) {
+	_PrdmaRegionUnlink(pdr);
+	_PrdmaRegionLink(pdr);
+    }
+    pdr->ref++;
+    *dmaaddr = pdr->dmaaddr[trans->slot]
+	+ (uint64_t) ((char*) addr - (char*) pdr->start);
+    return pdr->memid;
 }
 
+/*
+ * Memory hooks (PRDMA_MEMHOOK)
+ *	A registration stays valid while the pages under it are mapped.
+ *	munmap(), mremap() and madvise() of the application and of the
+ *	libraries are interposed, so that the cached regions on the pages
+ *	going away are taken out of the cache.  If asked for, the heap of
+ *	malloc() is never given back to the kernel either.  The calls inside
+ *	glibc, e.g., shrinking a thread arena, are not seen.  A region of
+ *	a live request is only taken out; its request must not have freed
+ *	its buffer.
+ */
+#ifdef PRDMA_USE_MEMHOOK
 static void
-_PrdmaFinalize()
+_PrdmaRegionInvalidate(void *addr, size_t len)
 {
-    int		mintime, maxtime;
+    static int		busy;
+    PrdmaDmaRegion	*pdr, *npdr;
+    char		*lo = addr, *hi = lo + len;
 
-    if (_prdmaInitialized == 0) return;
-    if (_prdmaStat) {
-	MPI_Reduce((void*)&_prdmaWaitTag, (void*)&mintime, 1, MPI_INT,
-		   MPI_MIN, 0, MPI_COMM_WORLD);
-	MPI_Reduce((void*)&_prdmaWaitTag, (void*)&maxtime, 1, MPI_INT,
-		   MPI_MAX, 0, MPI_COMM_WORLD);
-	if (_prdmaMyrank == 0) {
-	    fprintf(stderr, "**********************************************\n");
-	    fprintf(stderr, "Max total waiting time to obtain tags: %d usec\n",
-		    maxtime);
-	    fprintf(stderr, "Min total waiting time to obtain tags: %d usec\n",
-		    mintime);
-	    fprintf(stderr, "**********************************************\n");
+    if (_prdmaInitialized == 0 || busy
+	|| hi <= _prdmaDmaLo || _prdmaDmaHi <= lo) {
+	return;
+    }
+    busy = 1; /* the transports may unmap in deregmem */
+    for (pdr = _prdmaDmaLru; pdr != NULL; pdr = npdr) {
+	npdr = pdr->next;
+	if ((char*) pdr->start + pdr->size <= lo || hi <= (char*) pdr->start) {
+	    continue;
 	}
-#ifdef	USE_PRDMA_MSGSTAT
-	if (_prdmaMyrank < 8) {
-	    PrdmaMsgStat	*pm;
-	    int			i;
-	    for (i = 0; i < PRDMA_MSGSTAT_SIZE; i++) {
-		for (pm = &_prdmaSendstat[i]; pm; pm = pm->next) {
-		    if (pm->size > 0) {
-			fprintf(stderr, "[%d] send(%d) count(%d)\n",
-				_prdmaMyrank, pm->size, pm->count);
-		    }
-		}
+	if (pdr->ref == 0) {
+	    _PrdmaRegionDrop(pdr);
+	} else {
+	    if (_prdmaVerbose) {
+		_PrdmaPrintf(stderr, "memory of a request (%p, %ld) is "
+			     "unmapped\n", pdr->start, (long) pdr->size);
 	    }
-	    fflush(stderr);
+	    _PrdmaRegionUnlink(pdr);
 	}
-#endif	/* USE_PRDMA_MSGSTAT */
     }
-    if (_prdma_trc_fini != NULL) {
-	(*_prdma_trc_fini)(_prdmaTraceSize);
-    }
-
-    FJMPI_Rdma_finalize();
-    _prdmaInitialized = 0;
+    busy = 0;
 }
 
 static void
-_PrdmaInit()
+_PrdmaMemhookInit(void)
 {
-    int		size;
+    if (_prdmaMemhook == 0) return;
+    /* freed memory is kept in the heap, for the whole process */
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_TRIM_THRESHOLD, -1);
+}
 
-    if (_prdmaInitialized == 1) return;
+int
+munmap(void *addr, size_t len)
+{
+    static int	(*real)(void*, size_t);
+
+    if (real == NULL) {
+	real = (int (*)(void*, size_t)) dlsym(RTLD_NEXT, "munmap");
+    }
+    _PrdmaRegionInvalidate(addr, len);
+    return (*real)(addr, len);
+}
+
+void *
+mremap(void *oaddr, size_t osize, size_t nsize, int flags, ...)
+{
+    static void	*(*real)(void*, size_t, size_t, int, ...);
+    void	*naddr = NULL;
+    va_list	ap;
+
+    if (real == NULL) {
+	real = (void *(*)(void*, size_t, size_t, int, ...))
+	    dlsym(RTLD_NEXT, "mremap");
+    }
+    if (flags & MREMAP_FIXED) {
+	va_start(ap, flags);
+	naddr = va_arg(ap, void*);
+	va_end(ap);
+	_PrdmaRegionInvalidate(naddr, nsize);
+    }
+    _PrdmaRegionInvalidate(oaddr, osize);
+    return (*real)(oaddr, osize, nsize, flags, naddr);
+}
+
+int
+madvise(void *addr, size_t len, int advice)
+{
+    static int	(*real)(void*, size_t, int);
+
+    if (real == NULL) {
+	real = (int (*)(void*, size_t, int)) dlsym(RTLD_NEXT, "madvise");
+    }
+    switch (advice) {
+    case MADV_DONTNEED:
+#ifdef MADV_FREE
+    case MADV_FREE:
+#endif
+#ifdef MADV_REMOVE
+    case MADV_REMOVE:
+#endif
+	_PrdmaRegionInvalidate(addr, len);
+	break;
+    }
+    return (*real)(addr, len, advice);
+}
+#else
+static void
+_PrdmaMemhookInit(void)
+{
+}
+#endif	/* PRDMA_USE_MEMHOOK */
+
+int
+PrdmaReserveRegion(void *addr, int size)
+{
+    int         lbid;
+    uint64_t    lbaddr;
+
+    lbid = _PrdmaReserveRegion(_prdma_trans, &lbaddr, addr, size);
+    return lbid;
+}
+
+/*
+ * Memory arenas
+ *	PrdmaAlloc() and MPI_Alloc_mem() carve the memory out of arenas of
+ *	huge pages.  An arena is registered once as a region that is never
+ *	evicted, so that the requests on its memory find it in the cache
+ *	and take no other memid.  A block has a header of PRDMA_ARENA_ALIGN
+ *	bytes in front of it.  The free blocks of an arena are kept in the
+ *	order of their addresses, and a freed block is merged with its
+ *	neighbors.  A block larger than PRDMA_ARENASIZE has an arena of
+ *	its own.  The arenas are kept until the process exits.
+ */
+static PrdmaArena	*_prdmaArenas;
+
+static PrdmaArena *
+_PrdmaArenaNew(size_t size)
+{
+    PrdmaArena		*pa;
+    PrdmaArenaBlk	*blk;
+    char		*cp = MAP_FAILED;
+    size_t		len, off;
+    uint64_t		dmaaddr;
+
+    size = (size + PRDMA_HUGEPAGE - 1) & ~((size_t) PRDMA_HUGEPAGE - 1);
+    if (size > PRDMA_ARENA_MAXSIZE
+	|| (pa = (PrdmaArena*) malloc(sizeof(PrdmaArena))) == NULL) {
+	return NULL;
+    }
+#ifdef MAP_HUGETLB
+    cp = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if (cp == MAP_FAILED) {
+	/* no huge page is reserved: transparent ones on an aligned area */
+	len = size + PRDMA_HUGEPAGE;
+	cp = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (cp == MAP_FAILED) {
+	    free(pa);
+	    return NULL;
+	}
+	off = -(uintptr_t) cp & (PRDMA_HUGEPAGE - 1);
+	if (off > 0) {
+	    munmap(cp, off);
+	}
+	munmap(cp + off + size, len - off - size);
+	cp += off;
+#ifdef MADV_HUGEPAGE
+	madvise(cp, size, MADV_HUGEPAGE);
+#endif
+    }
+    pa->base = cp;
+    pa->size = size;
+    pa->memid = _PrdmaReserveRegion(_prdma_trans, &dmaaddr, cp, (int) size);
+    blk = (PrdmaArenaBlk*) cp;
+    blk->size = size;
+    blk->next = NULL;
+    pa->free = blk;
+    pa->next = _prdmaArenas;
+    _prdmaArenas = pa;
+    if (_prdmaVerbose) {
+	_PrdmaPrintf(stderr, "arena %p size %ld memid %d\n",
+		     cp, (long) size, pa->memid);
+    }
+    return pa;
+}
+
+/* first fit, size includes the header */
+static void *
+_PrdmaArenaGet(PrdmaArena *pa, size_t size)
+{
+    PrdmaArenaBlk	**pp, *blk, *rest;
+
+    for (pp = &pa->free; (blk = *pp) != NULL; pp = &blk->next) {
+	if (blk->size < size) {
+	    continue;
+	}
+	if (blk->size - size >= 2*PRDMA_ARENA_ALIGN) {
+	    rest = (PrdmaArenaBlk*) ((char*) blk + size);
+	    rest->size = blk->size - size;
+	    rest->next = blk->next;
+	    *pp = rest;
+	    blk->size = size;
+	} else {
+	    *pp = blk->next;
+	}
+	blk->next = NULL;
+	return (char*) blk + PRDMA_ARENA_ALIGN;
+    }
+    return NULL;
+}
+
+static void
+_PrdmaArenaPut(PrdmaArena *pa, void *ptr)
+{
+    PrdmaArenaBlk	*blk, *prev = NULL, *nb;
+
+    blk = (PrdmaArenaBlk*) ((char*) ptr - PRDMA_ARENA_ALIGN);
+    for (nb = pa->free; nb != NULL && nb < blk; nb = nb->next) {
+	prev = nb;
+    }
+    if (nb != NULL && (char*) blk + blk->size == (char*) nb) {
+	blk->size += nb->size;
+	blk->next = nb->next;
+    } else {
+	blk->next = nb;
+    }
+    if (prev == NULL) {
+	pa->free = blk;
+    } else if ((char*) prev + prev->size == (char*) blk) {
+	prev->size += blk->size;
+	prev->next = blk->next;
+    } else {
+	prev->next = blk;
+    }
+}
+
+static PrdmaArena *
+_PrdmaArenaOf(void *ptr)
+{
+    PrdmaArena	*pa;
+
+    for (pa = _prdmaArenas; pa != NULL; pa = pa->next) {
+	if (pa->base < (char*) ptr && (char*) ptr < pa->base + pa->size) {
+	    return pa;
+	}
+    }
+    return NULL;
+}
+
+/* NULL if the memory cannot be taken from an arena */
+static void *
+_PrdmaArenaAlloc(size_t size)
+{
+    PrdmaArena	*pa;
+    void	*vp;
+    size_t	asize;
+
+    if (_prdmaInitialized == 0 || _prdmaArenaSize <= 0
+	|| size > PRDMA_ARENA_MAXSIZE) {
+	return NULL;
+    }
+    size = PRDMA_ARENA_ALIGN
+	+ ((size + PRDMA_ARENA_ALIGN - 1) & ~((size_t) PRDMA_ARENA_ALIGN - 1));
+    for (pa = _prdmaArenas; pa != NULL; pa = pa->next) {
+	if ((vp = _PrdmaArenaGet(pa, size)) != NULL) {
+	    return vp;
+	}
+    }
+    asize = _prdmaArenaSize;
+    if (asize > PRDMA_ARENA_MAXSIZE) asize = PRDMA_ARENA_MAXSIZE;
+    if (asize < size) asize = size;
+    if ((pa = _PrdmaArenaNew(asize)) == NULL) {
+	return NULL;
+    }
+    return _PrdmaArenaGet(pa, size);
+}
+
+void *
+PrdmaAlloc(size_t size)
+{
+    void	*vp;
+
+    vp = _PrdmaArenaAlloc(size);
+    if (vp == NULL) {
+	vp = malloc(size);
+    }
+    return vp;
+}
+
+void
+PrdmaFree(void *ptr)
+{
+    PrdmaArena	*pa;
+
+    if (ptr == NULL) return;
+    if ((pa = _PrdmaArenaOf(ptr)) != NULL) {
+	_PrdmaArenaPut(pa, ptr);
+    } else {
+	free(ptr);
+    }
+}
+
+struct PrdmaOptions {
+    char	*sym;
+    int		*var;
+};
+
+static struct PrdmaOptions _poptions[] = {
+    { "PRDMA_DEBUG", &_prdmaDebug },
+    { "PRDMA_NOSYNC", &_prdmaNosync },
+    { "PRDMA_NOTRUNK", &_prdmaNoTrunk },
+    { "PRDMA_VERBOSE", &_prdmaVerbose },
+    { "PRDMA_STATISTIC", &_prdmaStat },
+    { "PRDMA_RDMASIZE", &_prdmaRdmaSize },
+    { "PRDMA_TRACESIZE", &_prdmaTraceSize },
+    { "PRDMA_TRACETYPE", &_prdmaTraceType },
+    { "PRDMA_STARTTOUT", &_prdmaStartTimeout },
+    { "PRDMA_TRANSPORT", &_prdmaTransport },
+    { "PRDMA_HYBRID", &_prdmaHybrid },
+    { "PRDMA_GETSIZE", &_prdmaGetSize },
+    { "PRDMA_FUSE", &_prdmaFuse },
+    { "PRDMA_RNOTICE", &_prdmaRnotice },
+    { "PRDMA_CREDIT", &_prdmaCredit },
+    { "PRDMA_PLAN", &_prdmaPlan },
+    { "PRDMA_MEMHOOK", &_prdmaMemhook },
+    { "PRDMA_ARENASIZE", &_prdmaArenaSize },
+    { "PRDMA_SUMMARY", &_prdmaSummary },
+    { "PRDMA_PTRACER", &_prdmaPtracer },
+    { 0, 0 }
+};
+
+static void
+_PrdmaOptions()
+{
+    struct PrdmaOptions	*po;
+    char		*cp;
+
+    for (po = _poptions; po->sym; po++) {
+	cp = getenv(po->sym);
+	if (cp) {
+	    *po->var = atoi(cp);
+	}
+    }
+    if (_prdmaVerbose && _prdmaMyrank == 0) {
+	_PrdmaPrintf(stderr, "Version prdma-%s\n", PRDMA_VERSION_STRING);
+	for (po = _poptions; po->sym; po++) {
+	    if (*po->var) {
+		_PrdmaPrintf(stderr, "%s is %d\n", po->sym, *po->var);
+	    } else {
+		_PrdmaPrintf(stderr, "%s is OFF\n", po->sym);
+	    }
+	}
+    }
+}
+
+static void
+_PrdmaFinalize()
+{
+    int		mintime, maxtime;
+    int		i;
+
+    if (_prdmaInitialized == 0) return;
+    if (_prdmaStat) {
+	MPI_Reduce((void*)&_prdmaWaitTag, (void*)&mintime, 1, MPI_INT,
+		   MPI_MIN, 0, MPI_COMM_WORLD);
+	MPI_Reduce((void*)&_prdmaWaitTag, (void*)&maxtime, 1, MPI_INT,
+		   MPI_MAX, 0, MPI_COMM_WORLD);
+	if (_prdmaMyrank == 0) {
+	    fprintf(stderr, "**********************************************\n");
+	    fprintf(stderr, "Max puts queued to obtain tags: %d\n",
+		    maxtime);
+	    fprintf(stderr, "Min puts queued to obtain tags: %d\n",
+		    mintime);
+	    fprintf(stderr, "**********************************************\n");
+	}
+#ifdef	USE_PRDMA_MSGSTAT
+	if (_prdmaMyrank < 8) {
+	    PrdmaMsgStat	*pm;
+	    int			i;
+	    for (i = 0; i < PRDMA_MSGSTAT_SIZE; i++) {
+		for (pm = &_prdmaSendstat[i]; pm; pm = pm->next) {
+		    if (pm->size > 0) {
+			fprintf(stderr, "[%d] send(%d) count(%d)\n",
+				_prdmaMyrank, pm->size, pm->count);
+		    }
+		}
+	    }
+	    fflush(stderr);
+	}
+#endif	/* USE_PRDMA_MSGSTAT */
+    }
+    if (_prdma_trc_fini != NULL) {
+	(*_prdma_trc_fini)(_prdmaTraceSize);
+    }
+
+    for (i = _prdmaTransNum - 1; i >= 0; i--) {
+	(*_prdmaTransTab[i]->fini)();
+    }
+    _prdmaInitialized = 0;
+}
+
+static void
+_PrdmaInit()
+{
+    int		i;
+
+    if (_prdmaInitialized == 1) return;
     MPI_Comm_size(MPI_COMM_WORLD, &_prdmaNprocs);
     MPI_Comm_rank(MPI_COMM_WORLD, &_prdmaMyrank);
     /* Used for exhange data between sender and receiver */
     MPI_Comm_dup(MPI_COMM_WORLD, &_prdmaInfoCom);
     MPI_Comm_dup(MPI_COMM_WORLD, &_prdmaMemidCom);
-    FJMPI_Rdma_init();
-    /* Synchronization structure is initialized */
-    {
-	/* from _PrdmaOptions() */
-	const char *cp = getenv("PRDMA_SYNCSIZE");
-	if (cp) {
-	    _prdmaSyncSize = atoi(cp);
+    _PrdmaOptions();
+    _PrdmaMemhookInit();
+    _PrdmaNodeInit();
+    _PrdmaTransinit();
+    for (i = 0; i < _prdmaTransNum; i++) {
+	if ((*_prdmaTransTab[i]->init)() == 0) {
+	    continue;
 	}
-	_prdmaMaxSync = (_prdmaSyncSize < 8)? 8: _prdmaSyncSize;
-    }
-    size = sizeof(uint32_t)*_prdmaMaxSync;
-    _prdmaSync = malloc(size);
-    _prdmaRdmaSync= malloc(sizeof(uint64_t)*_prdmaNprocs);
-    if (_prdmaSync == 0 || _prdmaRdmaSync == 0) {
+	if (_prdmaTransTab[i] == _prdma_trans_local) {
+	    /* the node is reached by _prdma_trans as well, the last one */
+	    (*_prdma_trans_local->fini)();
+	    if (_prdmaMyrank == 0) {
+		_PrdmaPrintf(stderr, "%s transport is not used, %s instead\n",
+			     _prdma_trans_local->name, _prdma_trans->name);
+	    }
+	    _prdma_trans_local = NULL;
+	    _prdmaTransNum--;
+	    break;
+	}
+	_PrdmaPrintf(stderr, "%s transport init failed\n",
+		     _prdmaTransTab[i]->name);
 	MPI_Abort(MPI_COMM_WORLD, -1);
 	return;
     }
-    memset((void*) _prdmaSync, PRDMA_SYNC_NOTUSED, size);
-    _prdmaSyncNumEntry = 0;
-    _prdmaDmaThisSync = FJMPI_Rdma_reg_mem(PRDMA_MEMID_SYNC,
-					   (char*) _prdmaSync, size);
-    /**/
+    /* Synchronization structure is initialized */
     _prdmaSyncConst[PRDMA_SYNC_CNSTMARKER] = PRDMA_SYNC_MARKER;
     _prdmaSyncConst[PRDMA_SYNC_CNSTFF_0] = PRDMA_SYNC_USED | PRDMA_SYNC_EVEN;
     _prdmaSyncConst[PRDMA_SYNC_CNSTFF_1] = PRDMA_SYNC_USED | PRDMA_SYNC_ODD;
-    _prdmaDmaSyncConst = FJMPI_Rdma_reg_mem(PRDMA_MEMID_SCONST,
-					     (char*) &_prdmaSyncConst,
-					     sizeof(_prdmaSyncConst));
-    memset((void*) _prdmaRdmaSync, 0, sizeof(uint64_t)*_prdmaNprocs);
+    for (i = 0; i < _prdmaTransNum; i++) {
+	_prdmaDmaSyncConst[i] = (*_prdmaTransTab[i]->regmem)(PRDMA_MEMID_SCONST,
+						(void*) &_prdmaSyncConst,
+						sizeof(_prdmaSyncConst));
+    }
     /* misc initializations */
     _prdmaMemid = PRDMA_MEMID_START;
-    _prdmaSyncNumEntry = 0;
-    memset(_prdmaDmaregs, 0, sizeof(_prdmaDmaregs));
-    _prdmaRequid = PRDMA_REQ_STARTUID;
-    _prdmaNumReq = 0;
+    _prdmaDmaLru = NULL;
+    _prdmaDmaLo = _prdmaDmaHi = NULL;
+    memset(_prdmaDmaById, 0, sizeof(_prdmaDmaById));
+    _prdmaMemidNfree = 0;
+    _prdmaSyncNseg = 0;
+    _PrdmaSyncGrow();
+    _PrdmaReqInit();
     _PrdmaTagInit();
-    _PrdmaOptions();
     _PrdmaNICinit();
     _PrdmaSynMBLinit();
     if (_prdmaTraceSize > 0) {
@@ -680,50 +1452,144 @@ _PrdmaInit()
     _prdmaInitialized = 1;
 }
 
+/* FJMPI_RDMA_NOTICE of an operation of the request */
+static void
+_PrdmaCQnotice(PrdmaReq *preq)
+{
+    if (preq->proto == PRDMA_PROTO_GET) {
+	if (
+	    (preq->pend > 1)
+	    || (preq->type == PRDMA_RTYPE_RECV && preq->sndst == 0)
+	) {
+	    /* more gets are pending or being issued */;
+	} else if (preq->state == PRDMA_RSTATE_START) {
+	    _PrdmaChangeState(preq,
+			      (preq->type == PRDMA_RTYPE_SEND)
+			      ? PRDMA_RSTATE_SENDER_SEND_DONE
+			      : PRDMA_RSTATE_RECEIVER_GOT_DATA, -1);
+	} else if (preq->state == PRDMA_RSTATE_RECEIVER_GOT_DATA) {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_RECEIVER_SYNC_SENT, -1);
+	} else {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, -1);
+	}
+    } else if (preq->type == PRDMA_RTYPE_SEND) {
+	if (
+	    preq->state == PRDMA_RSTATE_START
+	    && (preq->pend > 1)
+	) {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_SENDER_SENT_DATA, -1);
+	} else if (
+	    (preq->state == PRDMA_RSTATE_SENDER_SENT_DATA
+	     || preq->state == PRDMA_RSTATE_START /* fused */)
+	    && (preq->pend == 1)
+	) {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_SENDER_SEND_DONE, -1);
+	} else {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, -1);
+	}
+    } else {
+	/* receiver has sent sync entry to sender */
+	if (preq->credit > 0) {
+	    /* the credit has been returned */;
+	} else if (preq->state == PRDMA_RSTATE_START) {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_RECEIVER_SYNC_SENT, -1);
+	}
+	else {
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, -1);
+	}
+    }
+}
+
+/*
+ * _PrdmaTransFlush
+ *	The transports batching their operations make them visible now,
+ *	so that a peer does not wait for the next poll of this rank.
+ */
+static void
+_PrdmaTransFlush()
+{
+    int		t;
+
+    for (t = 0; t < _prdmaTransNum; t++) {
+	if (_prdmaTransTab[t]->flush != NULL) {
+	    (*_prdmaTransTab[t]->flush)();
+	}
+    }
+}
+
+/*
+ * Completion queues
+ *   A nic of a transport is polled while an operation issued on it has
+ *   not been noticed.  The nics of a transport raising remote notices
+ *   are always polled, since the puts of the peers fill their queues
+ *   whatever this rank does, and so are those of a transport whose
+ *   polling progresses the peers.  The other nics are looked at once
+ *   in PRDMA_CQ_IDLE calls.  A queue is drained up to PRDMA_CQ_BATCH
+ *   completions, and the puts waiting for the tags given back are
+ *   issued at the end of the batch.
+ */
 PrdmaReq	*
 _PrdmaCQpoll()
 {
-    int				i;
+    int				i, t, n, k;
     int				cc;
     struct FJMPI_Rdma_cq	cq;
     PrdmaReq	*preq = 0;
-
-    for (i = 0; i < PRDMA_NIC_NPAT; i++) {
-	cc = FJMPI_Rdma_poll_cq(_prdmaNICID[i], &cq);
-	switch (cc) {
-	case FJMPI_RDMA_NOTICE:
-	    preq = _PrdmaTag2Req(i /* nic */, cq.tag, cq.pid);
-	    if (preq == 0) break;
-	    if (preq->type == PRDMA_RTYPE_SEND) {
-		if (
-		    preq->state == PRDMA_RSTATE_START
-		    && (preq->pend > 1)
-		) {
-		    _PrdmaChangeState(preq, PRDMA_RSTATE_SENDER_SENT_DATA, -1);
-		} else if (
-		    preq->state == PRDMA_RSTATE_SENDER_SENT_DATA
-		    && (preq->pend == 1)
-		) {
-		    _PrdmaChangeState(preq, PRDMA_RSTATE_SENDER_SEND_DONE, -1);
-		} else {
-		    _PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, -1);
-		}
-	    } else {
-		/* receiver has sent sync entry to sender */
-		if (preq->state == PRDMA_RSTATE_START) {
-		    _PrdmaChangeState(preq, PRDMA_RSTATE_RECEIVER_SYNC_SENT, -1);
+    PrdmaTrans	*tr;
+    int		idle, watch, nnote, nwake;
+    int		wake[PRDMA_CQ_BATCH];	/* tag slots with queued puts */
+
+    idle = (++_prdmaCQcall % PRDMA_CQ_IDLE) == 0;
+    for (t = 0; t < _prdmaTransNum; t++) {
+	tr = _prdmaTransTab[t];
+	watch = tr->flags & (PRDMA_TRANS_F_PROGRESS | PRDMA_TRANS_F_RNOTICE);
+	for (i = 0; i < PRDMA_NIC_NPAT; i++) {
+	    if (_prdmaCQout[t][i] <= 0 && !watch && !idle) {
+		continue;
+	    }
+	    nnote = nwake = 0;
+	    for (n = 0; n < PRDMA_CQ_BATCH; n++) {
+		cc = (*tr->pollcq)(_prdmaNICID[i], &cq);
+		if (cc == 0) {
+		    break;
 		}
-		else {
-		    _PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, -1);
+		switch (cc) {
+		case FJMPI_RDMA_NOTICE:
+		    nnote++;
+		    preq = _PrdmaTag2Req(i /* nic */, cq.tag, cq.pid);
+		    if (preq == 0) break;
+		    _PrdmaCQnotice(preq);
+		    k = _PrdmaTagRelease(i /* nic */, cq.tag, cq.pid);
+		    if (k >= 0) {
+			wake[nwake++] = k;
+		    }
+		    break;
+		case FJMPI_RDMA_REMOTE_NOTICE:
+		    if (cq.tag >= _prdmaTagNum) {
+			/* data has arrived (PRDMA_RNOTICE) */
+			preq = _PrdmaRnTag2Req(i /* nic */, cq.tag, cq.pid);
+			if (preq != 0) {
+			    preq->rncnt++;
+			}
+		    }
+		    break;
+		default:
+		    break;
 		}
 	    }
-	    _PrdmaTagFree(i /* nic */, cq.tag, cq.pid);
-	    break;
-	case FJMPI_RDMA_REMOTE_NOTICE:
-	case 0:
-	    break;
+	    _prdmaCQout[t][i] -= nnote;
+	    if (_prdmaCQout[t][i] < 0) {
+		_PrdmaPrintf(stderr, "_PrdmaCQpoll: %d notices too many "
+			     "on nic %d of %s\n", -_prdmaCQout[t][i], i,
+			     tr->name);
+		PMPI_Abort(MPI_COMM_WORLD, -1);
+	    }
+	    for (k = 0; k < nwake; k++) {
+		_PrdmaPutQDrain(wake[k], i);
+	    }
 	}
     }
+    _PrdmaTransFlush();
     return preq;
 }
 
@@ -739,6 +1605,19 @@ retry:
     _PrdmaCQpoll();
     switch (preq->type) {
     case PRDMA_RTYPE_SEND:
+	if (preq->proto == PRDMA_PROTO_GET) {
+	    /* the receiver has got the data */
+	    if (preq->state != PRDMA_RSTATE_SENDER_SEND_DONE
+		|| PRDMA_SYNC_ENTRY(preq->lsync) != PRDMA_SYNC_MARKER) {
+		if (wait == 0) break;
+		goto retry;
+	    }
+	    PRDMA_SYNC_ENTRY(preq->lsync) = PRDMA_SYNC_USED;
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_DONE, -1);
+	    preq->done++;
+	    cc = 1;
+	    break;
+	}
 	if (preq->state != PRDMA_RSTATE_SENDER_SEND_DONE) {
 	    if (wait == 0) break;
 	    goto retry;
@@ -749,20 +1628,50 @@ retry:
 	cc = 1;
 	break;
     case PRDMA_RTYPE_RECV:
+	if (preq->proto == PRDMA_PROTO_GET) {
+	    cc = _PrdmaGetRecv(preq);
+	    if (cc == 0 && wait && preq->state != PRDMA_RSTATE_ERROR) {
+		goto retry;
+	    }
+	    break;
+	}
 	if (preq->state != PRDMA_RSTATE_RECEIVER_SYNC_SENT) {
 	    if(wait == 0) return 0;
 	    goto retry;
 	}
-	if (wait && _prdmaSync[preq->lsync] != PRDMA_SYNC_MARKER) {
-	    /* now waiting  */
-	    do {
-		/* we have to change */
-		usleep(1);
-	    } while (_prdmaSync[preq->lsync] != PRDMA_SYNC_MARKER);
+	if (preq->credit > 0) {
+	    /* the data of the next iteration is in the ring */
+	    if (!_PrdmaSyncReached(PRDMA_SYNC_ENTRY(preq->lsync), preq->cseq + 1)) {
+		if (wait == 0) break;
+		goto retry;
+	    }
+	    cc = _PrdmaCreditReturn(preq);
+	    break;
+	}
+	if (preq->rntag >= 0) {
+	    /* counted by the remote notice */
+	    if (preq->rncnt == 0) {
+		if (wait == 0) break;
+		goto retry;
+	    }
+	    preq->rncnt--;
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_DONE, -1);
+	    preq->done++;
+	    cc = 1;
+	    break;
+	}
+	if (wait && PRDMA_SYNC_ENTRY(preq->lsync) != PRDMA_SYNC_MARKER) {
+	    /* now waiting  */
+	    do {
+		/* we have to change */
+		usleep(1);
+		/* some transports need progress to get the marker */
+		_PrdmaCQpoll();
+	    } while (PRDMA_SYNC_ENTRY(preq->lsync) != PRDMA_SYNC_MARKER);
 	}
-	if (_prdmaSync[preq->lsync] == PRDMA_SYNC_MARKER) {
+	if (PRDMA_SYNC_ENTRY(preq->lsync) == PRDMA_SYNC_MARKER) {
 	    /* reset the variable */
-	    _prdmaSync[preq->lsync] = PRDMA_SYNC_USED;
+	    PRDMA_SYNC_ENTRY(preq->lsync) = PRDMA_SYNC_USED;
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_DONE, -1);
 	    preq->done++;
 	    cc = 1;
@@ -844,8 +1753,15 @@ retry:
 	int	flag = 0;
 
 	preq = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
-	if (preq == 0) {/* Regular Request */
-	    cc = PMPI_Test(&reqs[i], &flag, stats);
+	if (preq == 0 && cond == PRDMA_FIND_ALL) {/* Regular Request */
+	    /* completed below once all the requests are */
+	    cc = PMPI_Request_get_status(reqs[i], &flag, MPI_STATUS_IGNORE);
+	} else if (preq == 0) {
+	    /* one status for Waitany and Testany, or one per request */
+	    cc = PMPI_Test(&reqs[i], &flag,
+			   (cond == PRDMA_FIND_ANY) ? stats
+			   : (stats == MPI_STATUSES_IGNORE) ? MPI_STATUS_IGNORE
+			   : &stats[i]);
 	} else {
 	    cc = _PrdmaMultiTest0(&reqs[i], preq, &flag);
 	}
@@ -869,9 +1785,20 @@ retry:
 	/* Conidition of keeping polling
 	   (PRDMA_FIND_ALL && found < count) || (cond == PRDMA_FIND_SOME && found == 0)
 	   || (PRDMA_FIND_ANY && found == 0 */
+	/* the credits and the gets issued above */
+	_PrdmaTransFlush();
 	goto retry;
     }
 ret:
+    _PrdmaTransFlush();
+    if (cond == PRDMA_FIND_ALL && found == count) {
+	for (i = 0; i < count; i++) {
+	    if (_PrdmaReqFind((uint64_t)(unsigned long)reqs[i]) == 0) {
+		cc = PMPI_Wait(&reqs[i], (stats == MPI_STATUSES_IGNORE)
+			       ? MPI_STATUS_IGNORE : &stats[i]);
+	    }
+	}
+    }
     if (fnum != 0) *fnum = found;
     return cc;
 }
@@ -900,25 +1827,23 @@ _PrdmaOneCount(int count, int dsize, size_t transsize)
 
 
 PrdmaReq	*
-_PrdmaReqCommonSetup(PrdmaRtype type, int WPEERW, size_t transsize,
+_PrdmaReqCommonSetup(PrdmaReq *preq, PrdmaRtype type,
+		     int WPEERW, size_t transsize,
 		     int transcount, int lbid, uint64_t	lbaddr,
 		     void *buf, int count,
 		     MPI_Datatype datatype, int peer, int tag,
 		     MPI_Comm comm, MPI_Request *request)
 {
-    PrdmaReq	*preq;
     int		lsync;
 
     lsync = _PrdmaSyncGetEntry();
     if (lsync < 0) { /* never here */
 	return 0;
     }
-    preq = _PrdmaReqAlloc(type);
+    preq = _PrdmaReqAlloc(preq, type);
     if (preq == NULL) { /* never here */
 	return 0;
     }
-    /* checking if the synchronization structure has been obtained */
-    _PrdmaCheckRdmaSync(WPEERW);
     /*
      * All required resources have been allocated.
      */
@@ -926,6 +1851,15 @@ _PrdmaReqCommonSetup(PrdmaRtype type, int WPEERW, size_t transsize,
     PRDMA_SET_REQ(preq, buf, count, datatype, peer, tag, comm, request);
     preq->size = transsize;	/* transfer size in byte */
     preq->WPEERW = WPEERW;/* peer rank in COMM_WORLD_COMM */
+    preq->trans = _PrdmaPeerTrans(WPEERW); /* node-local or remote */
+    preq->tslot = _PrdmaTagSlot(WPEERW);
+    /* the sender chooses the protocol, and the receiver follows it */
+    preq->proto = PRDMA_PROTO_PUT;
+    preq->rntag = -1;
+    if (type == PRDMA_RTYPE_SEND && _prdmaGetSize > 0
+	&& transsize >= (size_t) _prdmaGetSize && preq->trans->get != NULL) {
+	preq->proto = PRDMA_PROTO_GET;
+    }
     preq->transcnt = transcount;/* actual count in this request */
     preq->lbid = lbid;		/* memid of local comm. buffer */
     preq->lbaddr = lbaddr;	/* dma address of local comm. buffer */
@@ -940,16 +1874,16 @@ _PrdmaReqCommonSetup(PrdmaRtype type, int WPEERW, size_t transsize,
 }
 
 static PrdmaReq *
-_PrdmaSendInit0(int worlddest, size_t transsize, int transcount,
-		int lbid, uint64_t lbaddr,
+_PrdmaSendInit0(PrdmaReq *preq, int worlddest, size_t transsize,
+		int transcount, int lbid, uint64_t lbaddr,
 		void *buf, int count, MPI_Datatype datatype,
 		int dest, int tag, MPI_Comm comm, MPI_Request *request)
 {
-    PrdmaReq	*preq;
+    struct recvinfo	info;
     int		flag = 0;
     MPI_Status	stat;
 
-    preq = _PrdmaReqCommonSetup(PRDMA_RTYPE_SEND,
+    preq = _PrdmaReqCommonSetup(preq, PRDMA_RTYPE_SEND,
 				worlddest, transsize, transcount, lbid, lbaddr,
 				buf, count, datatype,
 				dest, tag, comm, request);
@@ -959,13 +1893,27 @@ _PrdmaSendInit0(int worlddest, size_t transsize, int transcount,
     /* Needs remote memid to get the remote DMA address */
     MPI_Irecv(&preq->rinfo, sizeof(struct recvinfo), MPI_BYTE,
 	preq->WPEER, preq->tag, _prdmaInfoCom, &preq->negreq);
-    /* Send the DMA address of synch entry to dest. */
-    MPI_Bsend(&preq->lsync, sizeof(int), MPI_BYTE,
+    /*
+     * Send the synch entry to dest., and the local buf for
+     * the GET protocol
+     */
+    info._rbaddr = preq->lbaddr;
+    info._rbid = preq->lbid;
+    info._rboff = _PrdmaRegionOffset(preq);
+    info._rsync = preq->lsync;
+    info._rsmemid = PRDMA_SYNC_SEG(preq->lsync)->memid;
+    info._rfidx = preq->fidx;
+    info._rproto = preq->proto;
+    info._rtag = -1;
+    info._rsum = -1;
+    info._rcredit = 0;
+    MPI_Bsend(&info, sizeof(struct recvinfo), MPI_BYTE,
 	preq->WPEER, preq->tag, _prdmaMemidCom);
     /* now testing the previous request to get the remote memid */
     MPI_Test(&preq->negreq, &flag, &stat);
     if (flag) { 
 	/* The remote memid has been received */
+	_PrdmaNegotiated(preq);
 	_PrdmaChangeState(preq, PRDMA_RSTATE_PREPARED, -1);
 	if (_prdma_nic_sync != NULL) {
 	    (*_prdma_nic_sync)(preq);
@@ -982,11 +1930,11 @@ static int
 _PrdmaSendInit(int *tover, void *buf, int count, MPI_Datatype datatype,
 	       int dest, int tag, MPI_Comm comm, MPI_Request *req)
 {
-    PrdmaReq	*top, *next, *preq;
+    PrdmaReq	*blk, *top, *next, *preq;
     size_t	transsize;
     uint64_t	lbaddr;
     int		lbid, worlddest, result, dsize;
-    int		onecnt, rest, tcnt;
+    int		onecnt, rest, tcnt, i;
 
     switch (dest) {
     case MPI_PROC_NULL:
@@ -1015,22 +1963,26 @@ _PrdmaSendInit(int *tover, void *buf, int count, MPI_Datatype datatype,
     } else {
 	worlddest = _PrdmaGetCommWorldRank(comm, dest);
     }
-    lbid = _PrdmaReserveRegion(&lbaddr, buf, transsize);
+    lbid = _PrdmaReserveRegion(_PrdmaPeerTrans(worlddest),
+			       &lbaddr, buf, transsize);
     /*
      * Now constructing chunk of messages
      */
+    blk = _PrdmaReqBlockAlloc((count + onecnt - 1)/onecnt);
     top = next = 0;
     rest = count;
     tcnt = (rest >= onecnt) ? onecnt : rest;
     transsize = dsize*tcnt;
-    top = next = _PrdmaSendInit0(worlddest, transsize, tcnt, lbid, lbaddr,
+    top = next = _PrdmaSendInit0(PRDMA_REQ_AT(blk, 0),
+				 worlddest, transsize, tcnt, lbid, lbaddr,
 				 buf, tcnt, datatype, dest, tag, comm, req);
     lbaddr += transsize; buf = (void*)(((char*)buf) + transsize);
     rest -= tcnt;
-    while (rest > 0) {
+    for (i = 1; rest > 0; i++) {
 	tcnt = (rest >= onecnt) ? onecnt : rest;
 	transsize = dsize*tcnt;
-	preq = _PrdmaSendInit0(worlddest, transsize, tcnt, lbid, lbaddr,
+	preq = _PrdmaSendInit0(PRDMA_REQ_AT(blk, i),
+			       worlddest, transsize, tcnt, lbid, lbaddr,
 			       buf, tcnt, datatype, dest, tag, comm, req);
 	if (preq == NULL) goto notake; /* never in this case */
 	lbaddr += transsize; buf = (void*)(((char*)buf) + transsize);
@@ -1039,7 +1991,7 @@ _PrdmaSendInit(int *tover, void *buf, int count, MPI_Datatype datatype,
 	next = preq;
     }
     *tover = 1;
-    *req = (MPI_Request) top->uid;
+    *req = (MPI_Request)(unsigned long) top->uid;
     return MPI_SUCCESS;
 notake:
     *tover = 0;
@@ -1084,7 +2036,32 @@ MPI_Finalize()
 }
 
 int
-MPI_Send_init(void *buf, int count, MPI_Datatype datatype,
+MPI_Alloc_mem(MPI_Aint size, MPI_Info info, void *baseptr)
+{
+    void	*vp;
+
+    vp = _PrdmaArenaAlloc((size_t) size);
+    if (vp == NULL) {
+	return PMPI_Alloc_mem(size, info, baseptr);
+    }
+    *(void**) baseptr = vp;
+    return MPI_SUCCESS;
+}
+
+int
+MPI_Free_mem(void *base)
+{
+    PrdmaArena	*pa;
+
+    if ((pa = _PrdmaArenaOf(base)) == NULL) {
+	return PMPI_Free_mem(base);
+    }
+    _PrdmaArenaPut(pa, base);
+    return MPI_SUCCESS;
+}
+
+int
+MPI_Send_init(PRDMA_CONST void *buf, int count, MPI_Datatype datatype,
 	      int dest, int tag, MPI_Comm comm,
 	      MPI_Request *request)
 {
@@ -1092,25 +2069,169 @@ MPI_Send_init(void *buf, int count, MPI_Datatype datatype,
     int		cc;
 
     cc = _PrdmaSendInit(&tover,
-			buf, count, datatype, dest, tag, comm, request);
+			(void*)buf, count, datatype, dest, tag, comm, request);
     if (tover == 0) {
 	cc = PMPI_Send_init(buf, count, datatype, dest, tag, comm, request);
     }
     return cc;
 }
 
+/*
+ * Credit protocol (PRDMA_CREDIT > 1)
+ *   The receiver has a ring of PRDMA_CREDIT slots, and the sender puts
+ *   the data of its n-th iteration into the slot n % PRDMA_CREDIT
+ *   followed by the count n into the receiver's sync entry, instead of
+ *   SYNC_MARKER.  MPI_Wait of the receiver copies the slot to the user
+ *   buffer and puts the count of consumed iterations into the sender's
+ *   sync entry, which gives back the slot.  The sender does not wait
+ *   for MPI_Start of the receiver, but for a free slot, so that it may
+ *   run PRDMA_CREDIT iterations ahead.
+ *
+ * Sender			Receiver
+ *    MPI_Start			   MPI_Start (nothing)
+ *	while no slot is free
+ *	sending data to ring[n % credit]
+ *	sending n ---------------------->_prdmaSync[lsync]
+ *    MPI_Wait			   MPI_Wait
+ *				   	while _prdmaSync[lsync] < consumed + 1
+ *				   	copying ring[consumed % credit]
+ *	_prdmaSync[lsync] <-------------sending ++consumed
+ */
+static int
+_PrdmaCreditAlloc(PrdmaReq *preq)
+{
+    size_t	rsize;
+    int		memid;
+    int		i;
+
+    rsize = (size_t) _prdmaCredit * preq->size;
+    if (_prdmaCredit <= 1 || rsize > PRDMA_DMA_MAXSIZE) {
+	return 0;
+    }
+    memid = _PrdmaGetmemid();
+    if (memid < 0) {
+	/* flip/flop */
+	return 0;
+    }
+    preq->cring = malloc(rsize);
+    if (preq->cring == NULL) {
+	_prdmaErrorExit(10);
+	return 0; /* never return */
+    }
+    for (i = 0; i < _prdmaTransNum; i++) {
+	uint64_t	dmaaddr;
+
+	dmaaddr = (*_prdmaTransTab[i]->regmem)(memid, preq->cring, rsize);
+	if (dmaaddr == FJMPI_RDMA_ERROR) {
+	    _PrdmaPrintf(stderr, "%s: reg_mem failed\n",
+			 _prdmaTransTab[i]->name);
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	    return 0;
+	}
+	if (_prdmaTransTab[i] == preq->trans) {
+	    preq->cbase = dmaaddr;
+	}
+    }
+    preq->cmemid = memid;
+    preq->csync = _PrdmaSyncGetEntry();
+    preq->cseq = 0;
+    preq->credit = _prdmaCredit;
+    return preq->credit;
+}
+
+static void
+_PrdmaCreditFree(PrdmaReq *preq)
+{
+    int		i;
+
+    if (preq->credit == 0) return;
+    _PrdmaSyncFreeEntry(preq->csync);
+    if (preq->cring != NULL) {
+	for (i = 0; i < _prdmaTransNum; i++) {
+	    (*_prdmaTransTab[i]->deregmem)(preq->cmemid);
+	}
+	_PrdmaPutmemid(preq->cmemid);
+	free(preq->cring);
+	preq->cring = NULL;
+    }
+    preq->credit = 0;
+}
+
+/* sender: a slot of the receiver's ring is free */
+static int
+_PrdmaCreditReady(PrdmaReq *preq)
+{
+    return _PrdmaSyncReached(PRDMA_SYNC_ENTRY(preq->lsync),
+			     preq->cseq + 1 - preq->credit);
+}
+
+/* receiver: the slot is consumed and given back to the sender */
+static int
+_PrdmaCreditReturn(PrdmaReq *preq)
+{
+    int		cc;
+
+    memcpy(preq->buf,
+	   (char*) preq->cring + (preq->cseq % preq->credit)*preq->size,
+	   preq->size);
+    preq->cseq++;
+    PRDMA_SYNC_ENTRY(preq->csync) = PRDMA_SYNC_COUNT(preq->cseq);
+    cc = _PrdmaPut(preq, PRDMA_OP_SYNC, -1,
+		preq->rsaddr,
+		PRDMA_SYNC_DMA(preq->trans->slot, preq->csync),
+		sizeof(int), 0, 0, (*_prdma_nic_getf)(preq));
+    if (cc != 0) {
+	_PrdmaPrintf(stderr, "FJMPI_Rdma_put error in the receiver side\n");
+	_PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
+	return 0;
+    }
+    _PrdmaChangeState(preq, PRDMA_RSTATE_DONE, -1);
+    preq->done++;
+    return 1;
+}
+
+/* struct recvinfo of the peer has arrived */
+static void
+_PrdmaNegotiated(PrdmaReq *preq)
+{
+    /* the sync entry of the peer */
+    preq->rsaddr = (*preq->trans->raddr)(preq->WPEER, preq->rsmemid)
+	+ (preq->rsync & (PRDMA_SYNC_SEGSIZE - 1))
+	* PRDMA_SYNC_STRIDE*sizeof(uint32_t);
+    if (preq->rsum >= 0) {
+	preq->rsumaddr = (*preq->trans->raddr)(preq->WPEER, PRDMA_MEMID_SYNC)
+	    + PRDMA_SUMMARY_ENT(preq->rsum)*PRDMA_SYNC_STRIDE*sizeof(uint32_t);
+    }
+    if (preq->type == PRDMA_RTYPE_SEND) {
+	if (preq->proto == PRDMA_PROTO_PUT && preq->rcredit > 0) {
+	    /* the receiver has a ring */
+	    preq->cbase = _PrdmaRemoteBuf(preq);
+	    preq->csync = _PrdmaSyncGetEntry();
+	    preq->cseq = 0;
+	    preq->credit = preq->rcredit;
+	}
+	return;
+    }
+    /* the receiver follows the protocol of the sender */
+    preq->proto = preq->rproto;
+    if (preq->proto == PRDMA_PROTO_GET) {
+	/* no data is put */
+	_PrdmaRnTagFree(preq);
+	_PrdmaCreditFree(preq);
+    }
+}
+
 static PrdmaReq *
-_PrdmaRecvInit0(int worlddest, size_t transsize, int transcount, int lbid,
-		uint64_t lbaddr,
+_PrdmaRecvInit0(PrdmaReq *preq, int worlddest, size_t transsize,
+		int transcount, int lbid, uint64_t lbaddr,
 		void *buf, int count, MPI_Datatype datatype,
 		int source, int tag, MPI_Comm comm, MPI_Request *request)
 {
     struct recvinfo	info;
-    PrdmaReq	*preq;
     int		flag = 0;
     MPI_Status	stat;
 
-    preq = _PrdmaReqCommonSetup(PRDMA_RTYPE_RECV,
+    preq = _PrdmaReqCommonSetup(preq, PRDMA_RTYPE_RECV,
 				worlddest, transsize, transcount, lbid, lbaddr,
 				buf, count, datatype,
 				source, tag, comm, request);
@@ -1120,19 +2241,36 @@ _PrdmaRecvInit0(int worlddest, size_t transsize, int transcount, int lbid,
     /*
      * memid of buf is sent to the sender
      */
-    info._rbid = preq->lbid;
+    info._rcredit = _PrdmaCreditAlloc(preq);
+    if (preq->credit > 0) {
+	/* the sender puts the data into the ring */
+	info._rbaddr = preq->cbase;
+	info._rbid = preq->cmemid;
+	info._rboff = 0;
+    } else {
+	info._rbaddr = preq->lbaddr;
+	info._rbid = preq->lbid;
+	info._rboff = _PrdmaRegionOffset(preq);
+    }
     info._rsync = preq->lsync;
+    info._rsmemid = PRDMA_SYNC_SEG(preq->lsync)->memid;
     info._rfidx = preq->fidx;
+    info._rproto = PRDMA_PROTO_PUT;
+    info._rtag = (preq->credit > 0) ? -1 : _PrdmaRnTagGet(preq);
+    /* the sender puts SYNC_MARKER into the summary as well */
+    info._rsum = (_prdmaSummary && preq->credit == 0 && info._rtag < 0)
+	? (int) PRDMA_SUMMARY_GRP(preq->lsync) : -1;
     MPI_Bsend(&info, sizeof(struct recvinfo), MPI_BYTE,
 	preq->WPEER, preq->tag, _prdmaInfoCom);
     /*
      * Needs memid of the synchronization variable in the sender
      */
-    MPI_Irecv(&preq->rsync, sizeof(int), MPI_BYTE,
+    MPI_Irecv(&preq->rinfo, sizeof(struct recvinfo), MPI_BYTE,
 	preq->WPEER, preq->tag, _prdmaMemidCom, &preq->negreq);
     MPI_Test(&preq->negreq, &flag, &stat);
     if (flag) {
 	/* The memid of the synchronization variable has been received */
+	_PrdmaNegotiated(preq);
 	_PrdmaChangeState(preq, PRDMA_RSTATE_PREPARED, -1);
 	if (_prdma_nic_sync != NULL) {
 	    (*_prdma_nic_sync)(preq);
@@ -1148,11 +2286,11 @@ MPI_Recv_init(void *buf, int count, MPI_Datatype datatype,
 	      int source, int tag, MPI_Comm comm,
 	      MPI_Request *request)
 {
-    PrdmaReq	*top, *next, *preq;
+    PrdmaReq	*blk, *top, *next, *preq;
     size_t	transsize;
     uint64_t	lbaddr;
     int		lbid, worlddest, result, dsize;
-    int		onecnt, rest, tcnt;
+    int		onecnt, rest, tcnt, i;
     int		cc;
 
     switch (source) {
@@ -1180,23 +2318,27 @@ MPI_Recv_init(void *buf, int count, MPI_Datatype datatype,
     } else {
 	worlddest = _PrdmaGetCommWorldRank(comm, source);
     }
-    lbid = _PrdmaReserveRegion(&lbaddr, buf, transsize);
+    lbid = _PrdmaReserveRegion(_PrdmaPeerTrans(worlddest),
+			       &lbaddr, buf, transsize);
     /*
      * Now constructing chunk of messages
      */
+    blk = _PrdmaReqBlockAlloc((count + onecnt - 1)/onecnt);
     top = next = 0;
     rest = count;
     tcnt = (rest >= onecnt) ? onecnt : rest;
     transsize = dsize*tcnt;
-    top = next = _PrdmaRecvInit0(worlddest, transsize, tcnt, lbid, lbaddr,
+    top = next = _PrdmaRecvInit0(PRDMA_REQ_AT(blk, 0),
+				 worlddest, transsize, tcnt, lbid, lbaddr,
 				 buf, tcnt, datatype,
 				 source, tag, comm, request);
     lbaddr += transsize; buf = (void*)(((char*)buf) + transsize);
     rest -= tcnt;
-    while (rest > 0) {
+    for (i = 1; rest > 0; i++) {
 	tcnt = (rest >= onecnt) ? onecnt : rest;
 	transsize = dsize*tcnt;
-	preq = _PrdmaRecvInit0(worlddest, transsize, tcnt, lbid, lbaddr,
+	preq = _PrdmaRecvInit0(PRDMA_REQ_AT(blk, i),
+			       worlddest, transsize, tcnt, lbid, lbaddr,
 			       buf, tcnt, datatype,
 			       source, tag, comm, request);
 	if (preq == NULL) goto notake;  /* never in this case */
@@ -1205,22 +2347,176 @@ MPI_Recv_init(void *buf, int count, MPI_Datatype datatype,
 	next = preq;
 	rest -= tcnt;
     }
-    *request = (MPI_Request) top->uid;
+    *request = (MPI_Request)(unsigned long) top->uid;
     return MPI_SUCCESS;
 notake:
     cc = PMPI_Recv_init(buf, count, datatype, source, tag, comm, request);
     return cc;
 }
 
+/*
+ * Sending the data and SYNC_MARKER to the receiver's sync entry.
+ * If the transport can, a message of one fragment carries SYNC_MARKER
+ * as its trailing flag word, i.e., one tag and one notice.
+ */
+static int
+_PrdmaSendData(PrdmaReq *preq, int flag)
+{
+    uint64_t	sraddr, sladdr;
+    int		cc1, cc2;
+
+    sraddr = preq->rsaddr;
+    sladdr = _prdmaDmaSyncConst[preq->trans->slot]
+	+ sizeof(uint32_t)*PRDMA_SYNC_CNSTMARKER;
+    if (preq->credit > 0) {
+	/* the next slot of the ring, and the count instead of SYNC_MARKER */
+	preq->raddr = preq->cbase
+	    + (preq->cseq % preq->credit)*preq->size;
+	preq->cseq++;
+	PRDMA_SYNC_ENTRY(preq->csync) = PRDMA_SYNC_COUNT(preq->cseq);
+	sladdr = PRDMA_SYNC_DMA(preq->trans->slot, preq->csync);
+    }
+    if (preq->rtag >= 0) {
+	/* the remote notice of the tag tells the receiver */
+	cc1 = _PrdmaPut(preq, PRDMA_OP_PUT, preq->rtag, preq->raddr,
+			preq->lbaddr, preq->size, 0, 0, flag);
+	cc2 = 0;
+    } else if (_prdmaFuse && preq->trans->putf != NULL
+	       && preq->size < TOFU_MTU) {
+	cc1 = _PrdmaPut(preq, PRDMA_OP_PUTF, -1, preq->raddr,
+			preq->lbaddr, preq->size, sraddr, sladdr, flag);
+	cc2 = 0;
+    } else {
+	FJMPI_RDMA_FPUT(preq, flag, cc1);
+	/*
+	 * Make sure the ordering of the above transaction and the following
+	 * transaction
+	 */
+	cc2 = _PrdmaPut(preq, PRDMA_OP_SYNC, -1, sraddr, sladdr,
+			sizeof(int), 0, 0, flag);
+    }
+    if (cc1 == 0 && cc2 == 0 && preq->rsum >= 0) {
+	/* after SYNC_MARKER, the summary of the receiver */
+	cc2 = _PrdmaPut(preq, PRDMA_OP_SYNC, -1, preq->rsumaddr, sladdr,
+			sizeof(int), 0, 0, flag);
+    }
+    if (cc1 == 0 && cc2 == 0) {
+	return 0;
+    }
+    _PrdmaPrintf(stderr,
+		 "FJMPI_Rdma_put error in the sender side (%d, %d)\n",
+		 cc1, cc2);
+    return -1;
+}
+
+/*
+ * GET protocol
+ *   The sender does not wait for the receiver.  It puts the flip/flop
+ *   value into the sync entry of the receiver, and the receiver gets
+ *   the data and puts SYNC_MARKER into the sync entry of the sender.
+ *
+ * Sender			Receiver
+ *    MPI_Start			   MPI_Start
+ *	sending flip/flop value
+ *	   --------------------------->_prdmaSync[lsync]
+ *					get data from the sender's buf
+ *    MPI_Wait			   MPI_Wait
+ *	_prdmaSync[lsync] <-----	sending SYNC_MARKER
+ *	while _prdmaSync[lsync] != SYNC_MARKER
+ */
+static int
+_PrdmaGetStart(PrdmaReq *preq)
+{
+    int		cc;
+
+    preq->transff ^= PRDMA_SYNC_FLIP;
+    preq->sndst = 0;
+    if (preq->type == PRDMA_RTYPE_RECV) {
+	if (preq->raddr == (uint64_t) -1) {
+	    preq->raddr = _PrdmaRemoteBuf(preq);
+	}
+	_PrdmaChangeState(preq, PRDMA_RSTATE_START, -1);
+	_PrdmaGetRecv(preq);
+	return MPI_SUCCESS;
+    }
+    /* the data is ready */
+    cc = _PrdmaPut(preq, PRDMA_OP_SYNC, -1,
+		preq->rsaddr,
+		_prdmaDmaSyncConst[preq->trans->slot]
+		+ (preq->transff + PRDMA_SYNC_CNSTFF_0)*sizeof(uint32_t),
+		sizeof(int), 0, 0, (*_prdma_nic_getf)(preq));
+    if (cc == 0) {
+	_PrdmaChangeState(preq, PRDMA_RSTATE_START, -1);
+    } else {
+	_PrdmaPrintf(stderr, "FJMPI_Rdma_put error in the sender side\n");
+	_PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
+    }
+    return MPI_SUCCESS;
+}
+
+/*
+ * receiver of the GET protocol, returns 1 if done
+ *   sndst 0: waiting for the sender, 1: getting, 2: sending SYNC_MARKER
+ */
+static int
+_PrdmaGetRecv(PrdmaReq *preq)
+{
+    int		flag;
+    int		cc;
+
+    flag = (*_prdma_nic_getf)(preq);
+    switch (preq->state) {
+    case PRDMA_RSTATE_START:
+	if (preq->sndst != 0
+	    || PRDMA_SYNC_ENTRY(preq->lsync)
+		!= _prdmaSyncConst[preq->transff + PRDMA_SYNC_CNSTFF_0]) {
+	    break;
+	}
+	FJMPI_RDMA_FGET(preq, flag, cc);
+	if (cc != 0) {
+	    _PrdmaPrintf(stderr, "FJMPI_Rdma_get error in the receiver side\n");
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
+	    break;
+	}
+	preq->sndst = 1;
+	if (preq->pend == 0) {
+	    /* completed while being issued */
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_RECEIVER_GOT_DATA, -1);
+	}
+	break;
+    case PRDMA_RSTATE_RECEIVER_GOT_DATA:
+	if (preq->sndst != 1) {
+	    break;
+	}
+	preq->sndst = 2;
+	cc = _PrdmaPut(preq, PRDMA_OP_SYNC, -1,
+		preq->rsaddr,
+		_prdmaDmaSyncConst[preq->trans->slot]
+		+ sizeof(uint32_t)*PRDMA_SYNC_CNSTMARKER,
+		sizeof(int), 0, 0, flag);
+	if (cc != 0) {
+	    _PrdmaPrintf(stderr, "FJMPI_Rdma_put error in the receiver side\n");
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
+	}
+	break;
+    case PRDMA_RSTATE_RECEIVER_SYNC_SENT:
+	_PrdmaChangeState(preq, PRDMA_RSTATE_DONE, -1);
+	preq->done++;
+	return 1;
+    default:
+	break;
+    }
+    return 0;
+}
+
 int
 _PrdmaStart0(PrdmaReq *preq)
 {
-    int		cc1, cc2;
+    int		cc1;
     int		flag;
     int		idx;
     uint32_t	transid;
     uint64_t	raddr;
-    int		tag;
     MPI_Status	stat;
 
     if (preq->state == PRDMA_RSTATE_WAITRMEMID) {
@@ -1229,6 +2525,7 @@ _PrdmaStart0(PrdmaReq *preq)
 	 * In case of receiver, snch variable index(rsync) has not arrive.
 	 */
 	PMPI_Wait(&preq->negreq, &stat);
+	_PrdmaNegotiated(preq);
 	_PrdmaChangeState(preq, PRDMA_RSTATE_PREPARED, -1);
 	if (_prdma_nic_sync != NULL) {
 	    (*_prdma_nic_sync)(preq);
@@ -1242,12 +2539,15 @@ _PrdmaStart0(PrdmaReq *preq)
 	return MPI_ERR_INTERN;
     }
     flag = (*_prdma_nic_getf)(preq);
+    if (preq->proto == PRDMA_PROTO_GET) {
+	return _PrdmaGetStart(preq);
+    }
     switch (preq->type) {
     case PRDMA_RTYPE_SEND:
 	if (_prdma_syn_send != NULL) {
 	    /* remote address */
 	    if (preq->raddr == (uint64_t) -1) {
-		preq->raddr = FJMPI_Rdma_get_remote_addr(preq->WPEER, preq->rbid);
+		preq->raddr = _PrdmaRemoteBuf(preq);
 	    }
 	    preq->transff ^= PRDMA_SYNC_FLIP;
 	    preq->sndst = 0; /* dosync */
@@ -1257,53 +2557,41 @@ _PrdmaStart0(PrdmaReq *preq)
 	/* remote address */
 	idx = preq->lsync;
 	if (preq->raddr == (uint64_t) -1) {
-	    preq->raddr = FJMPI_Rdma_get_remote_addr(preq->WPEER, preq->rbid);
+	    preq->raddr = _PrdmaRemoteBuf(preq);
 	}
 	preq->transff ^= PRDMA_SYNC_FLIP;
-	if (_prdmaNosync == 0) {
+	if (preq->credit > 0) {
+	    /* a slot of the ring */
+	    while (!_PrdmaCreditReady(preq)) {
+		_PrdmaCQpoll();
+	    }
+	} else if (_prdmaNosync == 0) {
 	    /* Synchronization */
 	    transid = _prdmaSyncConst[preq->transff + PRDMA_SYNC_CNSTFF_0];
-	    while (_prdmaSync[idx] != transid) {
+	    while (PRDMA_SYNC_ENTRY(idx) != transid) {
 		usleep(1);
 	    }
 	}
 	/* start DMA */
 	_PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, 1 /* dosend */);
-	FJMPI_RDMA_FPUT(preq, flag, cc1);
-	/*
-	 * Make sure the ordering of the above transaction and the following
-	 * transaction
-	 */
-	tag = _PrdmaTagGet(preq);
-	cc2 = FJMPI_Rdma_put(preq->WPEER, tag,
-		_prdmaRdmaSync[preq->WPEER] + preq->rsync*sizeof(uint32_t),
-	        _prdmaDmaSyncConst + sizeof(uint32_t)*PRDMA_SYNC_CNSTMARKER,
-		sizeof(int), flag);
-	if (cc2 == 0) { preq->pend++; }
-	else { _PrdmaTagFree(preq->fidx /*nic*/, tag, preq->WPEER /*pid*/); }
-	if (cc1 == 0 && cc2 == 0) {
+	if (_PrdmaSendData(preq, flag) == 0) {
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_START, -1);
 	} else {
-	    _PrdmaPrintf(stderr,
-		    "FJMPI_Rdma_put error in the sender side (%d, %d)\n",
-		    cc1, cc2);
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
 	}
 	break;
     case PRDMA_RTYPE_RECV:
 	preq->transff ^= PRDMA_SYNC_FLIP;
-	if (_prdmaNosync == 1) { /* no synchronization */
+	if (_prdmaNosync == 1 || preq->credit > 0) {
+	    /* no synchronization, or the sender uses the ring */
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_RECEIVER_SYNC_SENT, -1);
 	} else {
 	    /* Synchronization */
-	    tag = _PrdmaTagGet(preq);
-	    raddr = _prdmaDmaSyncConst
+	    raddr = _prdmaDmaSyncConst[preq->trans->slot]
 		+ (preq->transff + PRDMA_SYNC_CNSTFF_0)*sizeof(uint32_t);
-	    cc1 = FJMPI_Rdma_put(preq->WPEER, tag,
-		 _prdmaRdmaSync[preq->WPEER] + preq->rsync*sizeof(uint32_t),
-				 raddr,  sizeof(int), flag);
-	    if (cc1 == 0) { preq->pend++; }
-	    else { _PrdmaTagFree(preq->fidx, tag, preq->WPEER); }
+	    cc1 = _PrdmaPut(preq, PRDMA_OP_SYNC, -1,
+		 preq->rsaddr,
+				 raddr,  sizeof(int), 0, 0, flag);
 	    if (cc1 == 0) {
 		_PrdmaChangeState(preq, PRDMA_RSTATE_START, -1);
 	    } else {
@@ -1343,101 +2631,506 @@ _PrdmaStart(PrdmaReq *top)
     return cc;
 }
 
-int
-MPI_Start(MPI_Request *request)
+/*
+ * Memoized request arrays
+ *	Stencil codes pass the same array of requests to MPI_Startall()
+ *	and MPI_Waitall() at every step.  The requests of such an array
+ *	are resolved once into a plan, which is reused while the address,
+ *	the count and the handles of the array are the same and no
+ *	request has been created or freed since (_prdmaReqEpoch).
+ */
+typedef struct PrdmaPlan {
+    MPI_Request		*reqs;		/* array of the application */
+    int			count;
+    int			cap;		/* size of the arrays below */
+    unsigned int	epoch;
+    unsigned long	use;		/* last use for the replacement */
+    MPI_Request		*handle;	/* handles when compiled */
+    PrdmaReq		**preq;		/* resolved, NULL: regular request */
+    int			*order;		/* MPI_Startall order, receives first */
+    PrdmaReq		**snd;		/* sends to be synchronized */
+    int			nsnd;
+    int			*pend;		/* not completed in MPI_Waitall */
+    unsigned char	*mark;		/* only SYNC_MARKER completes it */
+    unsigned char	*seen;		/* SYNC_MARKER found in MPI_Waitall */
+    volatile uint32_t	**mkent;	/* sync entries of those */
+    int			*mkreq;		/* and their index in reqs */
+    int			nmark;		/* entries, -1: not known yet */
+    int			mkoff[PRDMA_SUMMARY_NGRP + 1];	/* by group */
+    int			mkcap;
+} PrdmaPlan;
+
+#define PRDMA_PLAN_NUM	8
+static PrdmaPlan	_prdmaPlanTab[PRDMA_PLAN_NUM];
+static unsigned long	_prdmaPlanClock;
+
+/* returns the number of PRDMA requests, or -1 if no memory */
+static int
+_PrdmaPlanCompile(PrdmaPlan *pp, int count, MPI_Request *reqs)
 {
     PrdmaReq	*preq;
-    int		cc;
-
-    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
-    if (preq == 0) {/* Regular Request */
-	cc = PMPI_Start(request);
-    } else {
-	cc = _PrdmaStart(preq);
+    int		i, n, nprdma;
+
+    if (count > pp->cap) {
+	free(pp->handle); free(pp->preq); free(pp->order);
+	free(pp->snd); free(pp->pend); free(pp->mark); free(pp->seen);
+	pp->handle = malloc(sizeof(MPI_Request)*count);
+	pp->preq = malloc(sizeof(PrdmaReq*)*count);
+	pp->order = malloc(sizeof(int)*count);
+	pp->snd = malloc(sizeof(PrdmaReq*)*count);
+	pp->pend = malloc(sizeof(int)*count);
+	pp->mark = malloc(count);
+	pp->seen = malloc(count);
+	if (pp->handle == NULL || pp->preq == NULL || pp->order == NULL
+	    || pp->snd == NULL || pp->pend == NULL || pp->mark == NULL
+	    || pp->seen == NULL) {
+	    pp->cap = 0;
+	    pp->reqs = NULL;
+	    return -1;
+	}
+	pp->cap = count;
     }
-    if (_prdma_syn_wait != NULL) {
-	(*_prdma_syn_wait)(1, request);
+    nprdma = 0;
+    for (i = 0; i < count; i++) {
+	pp->handle[i] = reqs[i];
+	pp->preq[i] = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
+	if (pp->preq[i] != NULL) nprdma++;
     }
-    return cc;
-}
-
-int
-MPI_Startall(int count, MPI_Request *reqs)
-{
-    PrdmaReq	*preq;
-    int		i, ret;
-    int		cc = MPI_SUCCESS;
-
+    /* the order of the two passes of MPI_Startall() */
+    n = pp->nsnd = 0;
     for (i = 0; i < count; i++) {
-	preq = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
-	if (preq == 0) { /* Regular Request */
-	    ret = PMPI_Start(&reqs[i]);
-	} else {
-	    if (preq->type != PRDMA_RTYPE_RECV) {
-		continue;
-	    }
-	    ret = _PrdmaStart(preq);
+	preq = pp->preq[i];
+	if (preq == NULL || preq->type == PRDMA_RTYPE_RECV) {
+	    pp->order[n++] = i;
 	}
-	if (ret != MPI_SUCCESS) cc = ret;
     }
     for (i = 0; i < count; i++) {
-	preq = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
-	if (preq == 0) { /* Regular Request */
-	    continue;
-	} else {
-	    if (preq->type == PRDMA_RTYPE_RECV) {
-		continue;
-	    }
-	    ret = _PrdmaStart(preq);
+	preq = pp->preq[i];
+	if (preq != NULL && preq->type != PRDMA_RTYPE_RECV) {
+	    pp->order[n++] = i;
+	    pp->snd[pp->nsnd++] = preq;
 	}
-	if (ret != MPI_SUCCESS) cc = ret;
-    }
-    if (_prdma_syn_wait != NULL) {
-	(*_prdma_syn_wait)(count, reqs);
     }
-    return cc;
+    pp->reqs = reqs;
+    pp->count = count;
+    pp->epoch = _prdmaReqEpoch;
+    pp->nmark = -1;
+    return nprdma;
 }
 
 /*
- * MPI_Status must be setup !!!
+ * Marker scan
+ *	The sync entries of the receives which only SYNC_MARKER completes
+ *	are gathered in the plan, and MPI_Waitall and MPI_Testall look at
+ *	such a receive only once SYNC_MARKER is found in one of its
+ *	entries.  Those receives are known once the peers have told the
+ *	protocol, i.e., at the first MPI_Waitall of the plan.  The entries
+ *	are sorted by the summary group, and only the groups written since
+ *	the last scan are scanned again.
  */
-int
-MPI_Wait(MPI_Request *request, MPI_Status *status)
+static int
+_PrdmaMarkerScan(volatile uint32_t **ent, int *req, int n,
+		 unsigned char *seen)
 {
-    PrdmaReq	*preq;
-    int		flag;
-    int		cc;
+    int		j, nhit = 0;
 
-    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
-    if (preq == 0) {
-	/* Regular Request */
-	cc = PMPI_Wait(request, status);
-	return cc;
+    for (j = 0; j < n; j++) {
+	if (*ent[j] == PRDMA_SYNC_MARKER) {
+	    seen[req[j]] = 1;
+	    nhit++;
+	}
     }
-    /* wait */
-    flag = 0;
-    do {
-	_PrdmaMultiTest0(request, preq, &flag);
-    } while (flag == 0);
-    /*
-     *Because this is a persistent communication, the internal structure,
-     *  PrdmaReq, must be hold.
-     */
-    return MPI_SUCCESS;
+    return nhit;
 }
 
-int
-MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+static void
+_PrdmaPlanMark(PrdmaPlan *pp)
 {
-    int		cc;
     PrdmaReq	*preq;
-
-    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
-    if (preq == 0) {
-	/* Regular Request */
-	cc = PMPI_Test(request, flag, status);
-	return cc;
-    }
+    int		pos[PRDMA_SUMMARY_NGRP];
+    int		i, n, g;
+
+    n = 0;
+    memset(pp->mkoff, 0, sizeof(pp->mkoff));
+    for (i = 0; i < pp->count; i++) {
+	pp->mark[i] = (pp->preq[i] != NULL);
+	for (preq = pp->preq[i]; preq != NULL; preq = preq->trunks) {
+	    if (preq->type != PRDMA_RTYPE_RECV
+		|| preq->proto != PRDMA_PROTO_PUT || preq->credit > 0
+		|| preq->rntag >= 0) {
+		pp->mark[i] = 0;
+		break;
+	    }
+	}
+	if (pp->mark[i] == 0) continue;
+	for (preq = pp->preq[i]; preq != NULL; preq = preq->trunks) {
+	    pp->mkoff[PRDMA_SUMMARY_GRP(preq->lsync) + 1]++;
+	    n++;
+	}
+    }
+    if (n > pp->mkcap) {
+	free((void*) pp->mkent); free(pp->mkreq);
+	pp->mkent = malloc(sizeof(uint32_t*)*n);
+	pp->mkreq = malloc(sizeof(int)*n);
+	if (pp->mkent == NULL || pp->mkreq == NULL) {
+	    /* every request is polled */
+	    pp->mkcap = 0;
+	    pp->nmark = 0;
+	    memset(pp->mkoff, 0, sizeof(pp->mkoff));
+	    memset(pp->mark, 0, pp->count);
+	    return;
+	}
+	pp->mkcap = n;
+    }
+    for (g = 0; g < PRDMA_SUMMARY_NGRP; g++) {
+	pp->mkoff[g + 1] += pp->mkoff[g];
+	pos[g] = pp->mkoff[g];
+    }
+    for (i = 0; i < pp->count; i++) {
+	if (pp->mark[i] == 0) continue;
+	for (preq = pp->preq[i]; preq != NULL; preq = preq->trunks) {
+	    g = PRDMA_SUMMARY_GRP(preq->lsync);
+	    pp->mkent[pos[g]] = &PRDMA_SYNC_ENTRY(preq->lsync);
+	    pp->mkreq[pos[g]++] = i;
+	}
+    }
+    pp->nmark = n;
+}
+
+/* the groups written since the last call */
+static unsigned int
+_PrdmaSummaryTake(void)
+{
+    volatile uint32_t	*sum;
+    unsigned int	gr = 0;
+    int			i;
+
+    for (i = 0; i < PRDMA_SUMMARY_NGRP; i++) {
+	sum = &PRDMA_SYNC_ENTRY(PRDMA_SUMMARY_ENT(i));
+	if (*sum != 0) {
+	    *sum = 0;
+	    gr |= 1U << i;
+	}
+    }
+    if (gr != 0) {
+	/* cleared before the entries are looked at */
+	__sync_synchronize();
+    }
+    return gr;
+}
+
+static PrdmaPlan *
+_PrdmaPlanGet(int count, MPI_Request *reqs)
+{
+    PrdmaPlan	*pp, *old;
+
+    if (_prdmaPlan == 0 || count <= 1) {
+	return NULL;
+    }
+    old = &_prdmaPlanTab[0];
+    for (pp = _prdmaPlanTab; pp < &_prdmaPlanTab[PRDMA_PLAN_NUM]; pp++) {
+	if (pp->reqs == reqs && pp->count == count) {
+	    goto find;
+	}
+	if (pp->use < old->use) old = pp;
+    }
+    /* the least recently used one is replaced */
+    pp = old;
+    if (_PrdmaPlanCompile(pp, count, reqs) <= 0) {
+	/* nothing to gain if no PRDMA request */
+	pp->reqs = NULL;
+	return NULL;
+    }
+    pp->use = ++_prdmaPlanClock;
+    return pp;
+find:
+    if (pp->epoch != _prdmaReqEpoch
+	|| memcmp(pp->handle, reqs, sizeof(MPI_Request)*count) != 0) {
+	if (_PrdmaPlanCompile(pp, count, reqs) <= 0) {
+	    pp->reqs = NULL;
+	    return NULL;
+	}
+    }
+    pp->use = ++_prdmaPlanClock;
+    return pp;
+}
+
+static int
+_PrdmaPlanStartall(PrdmaPlan *pp, MPI_Request *reqs)
+{
+    PrdmaReq	*preq;
+    int		i, k, ret;
+    int		cc = MPI_SUCCESS;
+
+    for (k = 0; k < pp->count; k++) {
+	i = pp->order[k];
+	preq = pp->preq[i];
+	if (preq == NULL) { /* Regular Request */
+	    ret = PMPI_Start(&reqs[i]);
+	} else {
+	    ret = _PrdmaStart(preq);
+	}
+	if (ret != MPI_SUCCESS) cc = ret;
+    }
+    if (_prdma_syn_wait != NULL) {
+	_Prdma_Syn_waitp(pp->nsnd, NULL, pp->snd);
+    }
+    /* the markers and the data put above leave now */
+    _PrdmaTransFlush();
+    return cc;
+}
+
+/* MPI_Waitall if wait, or MPI_Testall */
+static int
+_PrdmaPlanWaitall(PrdmaPlan *pp, MPI_Request *reqs, MPI_Status *stats,
+		  int wait, int *done)
+{
+    int			i, k, g, npend, flag;
+    unsigned int	gr = ~0U;	/* all the groups at first */
+    int			cc = MPI_SUCCESS;
+
+    if (pp->nmark < 0) {
+	_PrdmaPlanMark(pp);
+    }
+    for (i = 0; i < pp->count; i++) {
+	pp->pend[i] = i;
+	pp->seen[i] = 0;
+    }
+    npend = pp->count;
+    /* only the requests not completed yet are polled again */
+    for (;;) {
+	for (g = 0; pp->nmark > 0 && g < PRDMA_SUMMARY_NGRP; g++) {
+	    if ((gr & (1U << g)) == 0) continue;
+	    _PrdmaMarkerScan(pp->mkent + pp->mkoff[g], pp->mkreq + pp->mkoff[g],
+			     pp->mkoff[g + 1] - pp->mkoff[g], pp->seen);
+	}
+	for (k = 0; k < npend; ) {
+	    i = pp->pend[k];
+	    if (pp->mark[i] && pp->seen[i] == 0
+		&& pp->preq[i]->state != PRDMA_RSTATE_DONE) {
+		/* no SYNC_MARKER has come yet, nor at a former MPI_Testall */
+		k++;
+		continue;
+	    }
+	    flag = 0;
+	    if (pp->preq[i] == NULL && wait == 0) { /* Regular Request */
+		/* MPI_Testall completes them only if all are done */
+		cc = PMPI_Request_get_status(reqs[i], &flag,
+					     MPI_STATUS_IGNORE);
+	    } else if (pp->preq[i] == NULL) {
+		cc = PMPI_Test(&reqs[i], &flag,
+			       (stats == MPI_STATUSES_IGNORE)
+			       ? MPI_STATUS_IGNORE : &stats[i]);
+	    } else {
+		cc = _PrdmaMultiTest0(&reqs[i], pp->preq[i], &flag);
+	    }
+	    if (flag) {
+		pp->pend[k] = pp->pend[--npend];
+	    } else {
+		k++;
+	    }
+	}
+	/* the credits and the gets issued above */
+	_PrdmaTransFlush();
+	if (npend == 0 || wait == 0) {
+	    break;
+	}
+	if (pp->nmark > 0) {
+	    /* the receives skipped above need progress */
+	    _PrdmaCQpoll();
+	    if (_prdmaSummary) {
+		/* SYNC_MARKER has come to some group since */
+		gr = _PrdmaSummaryTake();
+	    }
+	}
+    }
+    if (wait == 0 && npend == 0) {
+	for (i = 0; i < pp->count; i++) {
+	    if (pp->preq[i] == NULL) {
+		cc = PMPI_Wait(&reqs[i], (stats == MPI_STATUSES_IGNORE)
+			       ? MPI_STATUS_IGNORE : &stats[i]);
+	    }
+	}
+    }
+    *done = (npend == 0);
+    return cc;
+}
+
+/*
+ * Schedule
+ *	A plan owned by the application, with its own copy of the
+ *	handles, that is neither replaced nor checked at every step.
+ */
+struct PrdmaSchedule {
+    PrdmaPlan		plan;
+    MPI_Request		*reqs;
+};
+
+int
+PrdmaScheduleCreate(int count, MPI_Request *reqs, PrdmaSchedule *sched)
+{
+    PrdmaSchedule	ps;
+
+    *sched = NULL;
+    if (count <= 0) {
+	return MPI_ERR_COUNT;
+    }
+    ps = malloc(sizeof(struct PrdmaSchedule));
+    if (ps == NULL) {
+	return MPI_ERR_NO_MEM;
+    }
+    memset(ps, 0, sizeof(struct PrdmaSchedule));
+    ps->reqs = malloc(sizeof(MPI_Request)*count);
+    if (ps->reqs == NULL) {
+	free(ps);
+	return MPI_ERR_NO_MEM;
+    }
+    memcpy(ps->reqs, reqs, sizeof(MPI_Request)*count);
+    if (_PrdmaPlanCompile(&ps->plan, count, ps->reqs) < 0) {
+	PrdmaScheduleFree(&ps);
+	return MPI_ERR_NO_MEM;
+    }
+    *sched = ps;
+    return MPI_SUCCESS;
+}
+
+int
+PrdmaScheduleStart(PrdmaSchedule sched)
+{
+    return _PrdmaPlanStartall(&sched->plan, sched->reqs);
+}
+
+int
+PrdmaScheduleWait(PrdmaSchedule sched)
+{
+    int		done;
+
+    return _PrdmaPlanWaitall(&sched->plan, sched->reqs, MPI_STATUSES_IGNORE,
+			     1, &done);
+}
+
+int
+PrdmaScheduleFree(PrdmaSchedule *sched)
+{
+    PrdmaSchedule	ps = *sched;
+    PrdmaPlan		*pp;
+
+    if (ps == NULL) {
+	return MPI_SUCCESS;
+    }
+    pp = &ps->plan;
+    free(pp->handle); free(pp->preq); free(pp->order);
+    free(pp->snd); free(pp->pend); free(pp->mark); free(pp->seen);
+    free((void*) pp->mkent); free(pp->mkreq);
+    free(ps->reqs);
+    free(ps);
+    *sched = NULL;
+    return MPI_SUCCESS;
+}
+
+int
+MPI_Start(MPI_Request *request)
+{
+    PrdmaReq	*preq;
+    int		cc;
+
+    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
+    if (preq == 0) {/* Regular Request */
+	cc = PMPI_Start(request);
+    } else {
+	cc = _PrdmaStart(preq);
+    }
+    if (_prdma_syn_wait != NULL) {
+	(*_prdma_syn_wait)(1, request);
+    }
+    _PrdmaTransFlush();
+    return cc;
+}
+
+int
+MPI_Startall(int count, MPI_Request *reqs)
+{
+    PrdmaReq	*preq;
+    PrdmaPlan	*pp;
+    int		i, ret;
+    int		cc = MPI_SUCCESS;
+
+    if ((pp = _PrdmaPlanGet(count, reqs)) != NULL) {
+	return _PrdmaPlanStartall(pp, reqs);
+    }
+    for (i = 0; i < count; i++) {
+	preq = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
+	if (preq == 0) { /* Regular Request */
+	    ret = PMPI_Start(&reqs[i]);
+	} else {
+	    if (preq->type != PRDMA_RTYPE_RECV) {
+		continue;
+	    }
+	    ret = _PrdmaStart(preq);
+	}
+	if (ret != MPI_SUCCESS) cc = ret;
+    }
+    for (i = 0; i < count; i++) {
+	preq = _PrdmaReqFind((uint64_t)(unsigned long)reqs[i]);
+	if (preq == 0) { /* Regular Request */
+	    continue;
+	} else {
+	    if (preq->type == PRDMA_RTYPE_RECV) {
+		continue;
+	    }
+	    ret = _PrdmaStart(preq);
+	}
+	if (ret != MPI_SUCCESS) cc = ret;
+    }
+    if (_prdma_syn_wait != NULL) {
+	(*_prdma_syn_wait)(count, reqs);
+    }
+    /* once for all the requests */
+    _PrdmaTransFlush();
+    return cc;
+}
+
+/*
+ * MPI_Status must be setup !!!
+ */
+int
+MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+    PrdmaReq	*preq;
+    int		flag;
+    int		cc;
+
+    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
+    if (preq == 0) {
+	/* Regular Request */
+	cc = PMPI_Wait(request, status);
+	return cc;
+    }
+    /* wait */
+    flag = 0;
+    do {
+	_PrdmaMultiTest0(request, preq, &flag);
+    } while (flag == 0);
+    _PrdmaTransFlush();
+    /*
+     *Because this is a persistent communication, the internal structure,
+     *  PrdmaReq, must be hold.
+     */
+    return MPI_SUCCESS;
+}
+
+int
+MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+{
+    int		cc;
+    PrdmaReq	*preq;
+
+    preq = _PrdmaReqFind((uint64_t)(unsigned long)request[0]);
+    if (preq == 0) {
+	/* Regular Request */
+	cc = PMPI_Test(request, flag, status);
+	return cc;
+    }
     if (preq->state == PRDMA_RSTATE_ERROR) {
 	/* It has been the error state */
 	_PrdmaReqfree(preq);
@@ -1446,6 +3139,7 @@ MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
     }
     /* test */
     _PrdmaMultiTest0(request, preq, flag);
+    _PrdmaTransFlush();
     return MPI_SUCCESS;
 }
 
@@ -1493,7 +3187,11 @@ MPI_Waitall(int count, MPI_Request *reqs, MPI_Status *stats)
 {
     int		cc;
     int		fnum;
+    PrdmaPlan	*pp;
 
+    if ((pp = _PrdmaPlanGet(count, reqs)) != NULL) {
+	return _PrdmaPlanWaitall(pp, reqs, stats, 1, &fnum);
+    }
     cc = _PrdmaMultiTest(1, PRDMA_FIND_ALL, 0, &fnum, count, reqs, stats);
     return cc;
 }
@@ -1503,7 +3201,11 @@ MPI_Testall(int count, MPI_Request *reqs,int *flag, MPI_Status *stats)
 {
     int		cc;
     int		fnum;
+    PrdmaPlan	*pp;
 
+    if ((pp = _PrdmaPlanGet(count, reqs)) != NULL) {
+	return _PrdmaPlanWaitall(pp, reqs, stats, 0, flag);
+    }
     cc = _PrdmaMultiTest(0, PRDMA_FIND_ALL, 0, &fnum, count, reqs, stats);
     if (fnum == count) *flag = 1;
     else *flag = 0;
@@ -1531,13 +3233,13 @@ MPI_Testsome(int count, MPI_Request *reqs,
 }
 
 int
-MPI_Bsend_init(void *buf, int count, MPI_Datatype datatype,
+MPI_Bsend_init(PRDMA_CONST void *buf, int count, MPI_Datatype datatype,
 	       int dest, int tag, MPI_Comm comm, MPI_Request *request)
 {
     int		tover;
     int		cc;
     cc = _PrdmaSendInit(&tover,
-			buf, count, datatype, dest, tag, comm, request);
+			(void*)buf, count, datatype, dest, tag, comm, request);
     if (tover == 0) {
 	cc = PMPI_Bsend_init(buf, count, datatype, dest, tag, comm, request);
     }
@@ -1545,12 +3247,12 @@ MPI_Bsend_init(void *buf, int count, MPI_Datatype datatype,
 }
 
 int
-MPI_Ssend_init(void *buf, int count, MPI_Datatype datatype,
+MPI_Ssend_init(PRDMA_CONST void *buf, int count, MPI_Datatype datatype,
 	       int dest, int tag, MPI_Comm comm, MPI_Request *request)
 {
     int		tover;
     int		cc;
-    cc = _PrdmaSendInit(&tover,	buf, count, datatype, dest, tag, comm, request);
+    cc = _PrdmaSendInit(&tover,	(void*)buf, count, datatype, dest, tag, comm, request);
     if (tover == 0) {
 	cc = PMPI_Ssend_init(buf, count, datatype, dest, tag, comm, request);
     }
@@ -1558,12 +3260,12 @@ MPI_Ssend_init(void *buf, int count, MPI_Datatype datatype,
 }
 
 int
-MPI_Rsend_init(void *buf, int count, MPI_Datatype datatype,
+MPI_Rsend_init(PRDMA_CONST void *buf, int count, MPI_Datatype datatype,
 	       int dest, int tag, MPI_Comm comm, MPI_Request *request)
 {
     int		tover;
     int		cc;
-    cc = _PrdmaSendInit(&tover,	buf, count, datatype, dest, tag, comm, request);
+    cc = _PrdmaSendInit(&tover,	(void*)buf, count, datatype, dest, tag, comm, request);
     if (tover == 0) {
 	cc = PMPI_Rsend_init(buf, count, datatype, dest, tag, comm, request);
     }
@@ -1588,10 +3290,10 @@ MPI_Request_c2f(MPI_Request request)
 MPI_Request MPI_Request_f2c(MPI_Fint request)
 {
     PrdmaReq	*preq;
+    uint64_t	id = (uint64_t)request - PRDMA_F_TO_C_OFFSET;
 
-    if (request >= PRDMA_F_TO_C_OFFSET) {
-	request -= PRDMA_F_TO_C_OFFSET;
-	preq = _PrdmaReqFind((uint64_t)request);
+    if (request >= PRDMA_F_TO_C_OFFSET && PRDMA_REQ_ISHANDLE(id)) {
+	preq = _PrdmaReqFind(id);
 	if (preq == 0) {
 	    _PrdmaPrintf(stderr, "MPI_Request_f2c: unexpected error %u\n",
 		request);
@@ -1606,12 +3308,12 @@ MPI_Request MPI_Request_f2c(MPI_Fint request)
     } else {
 	int ir, *c_req;
 	
-	if (preq->uid >= DUMMY_REQUEST_COUNT) {
+	ir = PRDMA_REQ_SLOT(preq->uid);
+	if (ir >= DUMMY_REQUEST_COUNT) {
 	    _PrdmaPrintf(stderr, "MPI_Request_f2c: uid %d >= %d\n",
 		preq->uid, DUMMY_REQUEST_COUNT);
 	    PMPI_Abort(MPI_COMM_WORLD, -1);
 	}
-	ir = preq->uid;
 	/*
 	 * openmpi-1.6.1/ompi/mpi/f77/wait_f.c :
 	 *   c_req->req_f_to_c_index
@@ -1727,9 +3429,7 @@ static int
 _Prdma_Syn_send(PrdmaReq *preq)
 {
     int		ret = 0;
-    int		cc1, cc2;
     int		flag;
-    int		tag;
     int		idx;
     uint32_t	transid;
     int		giveup, nloops;
@@ -1754,14 +3454,22 @@ _Prdma_Syn_send(PrdmaReq *preq)
     }
     switch (preq->sndst) {
     case 0: /* dosync */
-	if (_prdmaNosync == 0) {
+	if (preq->credit > 0) {
+	    /* a slot of the ring */
+	    if (!_PrdmaCreditReady(preq)) {
+		_PrdmaCQpoll();
+		goto bad;
+	    }
+	} else if (_prdmaNosync == 0) {
 	    giveup = 50; /* XXX */
 	    nloops = 0;
 	    /* Synchronization */
 	    idx = preq->lsync;
 	    transid = _prdmaSyncConst[preq->transff + PRDMA_SYNC_CNSTFF_0];
-	    while (_prdmaSync[idx] != transid) {
+	    while (PRDMA_SYNC_ENTRY(idx) != transid) {
 		if (nloops++ >= giveup) {
+		    /* some transports need progress to get the sync */
+		    _PrdmaCQpoll();
 		    goto bad; /* XXX is not an error */
 		}
 	    }
@@ -1772,25 +3480,10 @@ _Prdma_Syn_send(PrdmaReq *preq)
 	_PrdmaChangeState(preq, PRDMA_RSTATE_UNKNOWN, 1 /* dosend */);
 	flag = (*_prdma_nic_getf)(preq); /* MOD_PRDMA_NIC_SEL */
 	/* start DMA */
-	FJMPI_RDMA_FPUT(preq, flag, cc1);
-	/*
-	 * Make sure the ordering of the above transaction and the following
-	 * transaction
-	 */
-	tag = _PrdmaTagGet(preq);
-	cc2 = FJMPI_Rdma_put(preq->WPEER, tag,
-		_prdmaRdmaSync[preq->WPEER] + preq->rsync*sizeof(uint32_t),
-	        _prdmaDmaSyncConst + sizeof(uint32_t)*PRDMA_SYNC_CNSTMARKER,
-		sizeof(int), flag);
-	if (cc2 == 0) { preq->pend++; }
-	else { _PrdmaTagFree(preq->fidx /*nic*/, tag, preq->WPEER /*pid*/); }
-	if (cc1 == 0 && cc2 == 0) {
+	if (_PrdmaSendData(preq, flag) == 0) {
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_START, -1);
 	    ret = 1;
 	} else {
-	    _PrdmaPrintf(stderr,
-		    "FJMPI_Rdma_put error in the sender side (%d, %d)\n",
-		    cc1, cc2);
 	    _PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
 	}
 	preq->sndst = 0; /* dosync */
@@ -1800,11 +3493,14 @@ bad:
     return ret;
 }
 
+/*
+ * The requests are given by the handles, or resolved in preqs
+ */
 static int
-_Prdma_Syn_wait(int nreq, MPI_Request *reqs)
+_Prdma_Syn_waitp(int nreq, MPI_Request *reqs, PrdmaReq **preqs)
 {
     int ir;
-    uint64_t ts, te;
+    uint64_t ts = 0, te;
     int doretry;
 
     if (_prdma_to_tsc > 0) {
@@ -1815,7 +3511,8 @@ retry:
     for (ir = 0; ir < nreq; ir++) {
 	PrdmaReq	*head, *preq;
 	
-	head = _PrdmaReqFind((uint64_t)(unsigned long)reqs[ir]);
+	head = (preqs != NULL) ? preqs[ir]
+	    : _PrdmaReqFind((uint64_t)(unsigned long)reqs[ir]);
 	if (head == 0) { /* Regular Request */
 	    continue;
 	}
@@ -1831,7 +3528,7 @@ retry:
 	    }
 	    /*
 	     * _Prdma_Syn_wait() -> _Prdma_Syn_send()
-	     *   -> _PrdmaTagGet() -> _PrdmaCQpoll()
+	     *   -> _PrdmaCQpoll()
 	     */
 	    if (
 		(preq->state == PRDMA_RSTATE_SENDER_SENT_DATA)
@@ -1861,6 +3558,12 @@ retry:
     return MPI_SUCCESS;
 }
 
+static int
+_Prdma_Syn_wait(int nreq, MPI_Request *reqs)
+{
+    return _Prdma_Syn_waitp(nreq, reqs, NULL);
+}
+
 static void
 _PrdmaSynMBLinit(void)
 {
@@ -1869,85 +3572,196 @@ _PrdmaSynMBLinit(void)
 }
 
 
+/*
+ * Tags
+ *   A peer has a slot of _prdmaTagPeer when the first request to it is
+ *   set up, and a tag of a nic and the peer is a bit of the slot.  A
+ *   tag is taken and given back by a bit of the free mask, and the
+ *   request of a completion is found by the slot of cq.pid.
+ *   A put which finds no free tag, or puts of the nic and the peer
+ *   queued already, goes to the queue of the slot, and it is issued by
+ *   _PrdmaTagFree() when a tag comes back.  MPI_Start does not wait
+ *   for a tag, and the puts to a peer are issued in order.
+ */
+typedef struct PrdmaPutQ {
+    struct PrdmaPutQ	*next;
+    PrdmaReq		*preq;
+    int			op;		/* PRDMA_OP_* */
+    int			tag;		/* the given tag, or -1 */
+    int			flag;
+    uint64_t		raddr, laddr;
+    size_t		size;
+    uint64_t		sraddr, sladdr;	/* flag word of PRDMA_OP_PUTF */
+} PrdmaPutQ;
+
+typedef struct PrdmaTagPeer {
+    PrdmaReq		*req[PRDMA_NIC_NPAT][PRDMA_TAG_MAX];
+    uint16_t		free[PRDMA_NIC_NPAT];	/* bit set: free */
+    PrdmaPutQ		*qhead[PRDMA_NIC_NPAT];	/* puts waiting for a tag */
+    PrdmaPutQ		*qtail[PRDMA_NIC_NPAT];
+} PrdmaTagPeer;
+
 /* variables */
-static PrdmaReq		*_prdmaTagTab[PRDMA_NIC_NPAT][PRDMA_TAG_MAX];
+static PrdmaTagPeer	*_prdmaTagPeer;
+static int		_prdmaTagNpeer, _prdmaTagMpeer;
+static int		*_prdmaTagSlot;	/* slot of a rank of COMM_WORLD */
+static PrdmaPutQ	*_prdmaPutQfree;
 
 /* functions */
 static int
-_PrdmaTagGet(PrdmaReq *pr)
+_PrdmaTagSlot(int pid)
+{
+    PrdmaTagPeer	*tp;
+    int			i, n;
+
+    if (_prdmaTagSlot[pid] >= 0) {
+	return _prdmaTagSlot[pid];
+    }
+    if (_prdmaTagNpeer == _prdmaTagMpeer) {
+	n = (_prdmaTagMpeer == 0) ? 16 : _prdmaTagMpeer*2;
+	tp = realloc(_prdmaTagPeer, sizeof(PrdmaTagPeer)*n);
+	if (tp == NULL) {
+	    _PrdmaPrintf(stderr, "_PrdmaTagSlot: no memory\n");
+	    PMPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	_prdmaTagPeer = tp;
+	_prdmaTagMpeer = n;
+    }
+    tp = &_prdmaTagPeer[_prdmaTagNpeer];
+    memset(tp, 0, sizeof(PrdmaTagPeer));
+    for (i = 0; i < PRDMA_NIC_NPAT; i++) {
+	tp->free[i] = (1 << PRDMA_TAG_MAX) - 1;
+    }
+    _prdmaTagSlot[pid] = _prdmaTagNpeer;
+    return _prdmaTagNpeer++;
+}
+
+/* the given tag, or a free one if tag < 0; -1 if busy */
+static int
+_PrdmaTagTake(PrdmaReq *pr, int tag)
 {
-    int		ent, tag, nic;
-    int		retries = 0;
+    PrdmaTagPeer	*tp;
+    unsigned int	m;
+    int			ent, nic;
 
     nic = pr->fidx;
 #ifndef	notyet
     if ((nic < 0) || (nic >= PRDMA_NIC_NPAT)) {
-	_PrdmaPrintf(stderr, "_PrdmaTagGet: bad nic %d\n", nic);
+	_PrdmaPrintf(stderr, "_PrdmaTagTake: bad nic %d\n", nic);
 	PMPI_Abort(MPI_COMM_WORLD, -1);
     }
 #endif	/* notyet */
-    ent =
-	  ((pr->WPEER & 0x0000000f) >>  0)
-	+ ((pr->WPEER & 0x000f0000) >> 16)
-	+ ((pr->WPEER & 0x0f000000) >> 24)
-	;
-    ent &= 0x0f;
-    if ((ent < 0) || (ent >= PRDMA_TAG_MAX)) {
-	ent = 0;
-    }
-retry:
-    retries++;
-    tag = ent;
-    do {
-	PrdmaReq *preq;
-	PrdmaReq **prev = &_prdmaTagTab[nic][tag];
-	
-	while ((preq = *prev) != 0) {
-	    if (preq == pr) {
-		break;
-	    }
-	    if (
-		(preq->WPEER == pr->WPEER)
-		/* && (preq->fidx == nic) */
-	    ) {
-		break;
-	    }
-	    prev = &preq->tnxt[tag]; /* tag next */
-	}
-	if (preq == 0) {
-#ifdef	notyet
-	    pr->tnxt[tag] = 0;
-#else	/* notyet */
-	    if (pr->tnxt[tag] != 0) {
-		_PrdmaPrintf(stderr, "_PrdmaTagGet: req busy\n");
-		PMPI_Abort(MPI_COMM_WORLD, -1);
-	    }
-#endif	/* notyet */
-	    prev[0] = pr;
-	    return tag;
+    tp = &_prdmaTagPeer[pr->tslot];
+    if (tag >= 0) {
+	m = tp->free[nic] & (1U << tag);
+    } else {
+	m = tp->free[nic] & ((1U << _prdmaTagNum) - 1);
+	ent =
+	      ((pr->WPEER & 0x0000000f) >>  0)
+	    + ((pr->WPEER & 0x000f0000) >> 16)
+	    + ((pr->WPEER & 0x0f000000) >> 24)
+	    ;
+	ent &= 0x0f;
+	if ((ent < 0) || (ent >= _prdmaTagNum)) {
+	    ent = 0;
 	}
-	tag++;
-	if (tag >= PRDMA_TAG_MAX) {
-	    tag = 0;
+	/* the first free tag from ent, round */
+	if ((m >> ent) != 0) {
+	    m &= ~0U << ent;
 	}
-    } while (tag != ent);
-
-    /* no more tag */
-    _PrdmaCQpoll();
-    if (retries < 10000) {
-	_prdmaWaitTag++;
-	usleep(1);
-	goto retry;
     }
-    _PrdmaPrintf(stderr, "_PrdmaTagGet: no more tag\n");
-    PMPI_Abort(MPI_COMM_WORLD, -1);
-    return -1;
+    if (m == 0) {
+	return -1;
+    }
+    tag = __builtin_ctz(m);
+    tp->free[nic] &= ~(1U << tag);
+    tp->req[nic][tag] = pr;
+    return tag;
 }
 
-static void
-_PrdmaTagFree(int nic, int tag, int pid)
+static int
+_PrdmaPutIssue(PrdmaReq *preq, int op, int tag,
+	       uint64_t raddr, uint64_t laddr, size_t size,
+	       uint64_t sraddr, uint64_t sladdr, int flag)
 {
-    PrdmaReq	*preq, **prev, **found = 0;
+    int		cc;
+
+    switch (op) {
+    case PRDMA_OP_GET:
+	cc = (*preq->trans->get)(preq->WPEER, tag, raddr, laddr, size, flag);
+	break;
+    case PRDMA_OP_PUTF:
+	cc = (*preq->trans->putf)(preq->WPEER, tag, raddr, laddr, size,
+				  sraddr, sladdr, flag);
+	break;
+    case PRDMA_OP_SYNC:
+	if (preq->trans->flags & PRDMA_TRANS_F_SYNCWORD) {
+	    flag |= PRDMA_PUT_SYNCWORD;
+	}
+	cc = (*preq->trans->put)(preq->WPEER, tag, raddr, laddr, size, flag);
+	break;
+    default:
+	cc = (*preq->trans->put)(preq->WPEER, tag, raddr, laddr, size, flag);
+	break;
+    }
+    if (cc == 0) {
+	_prdmaCQout[preq->trans->slot][preq->fidx]++;
+    }
+    return cc;
+}
+
+/*
+ * A put, get or putf of the request with a tag, or queued if no tag is
+ * free.  It is counted in preq->pend either way.  Returns 0 if issued
+ * or queued.
+ */
+static int
+_PrdmaPut(PrdmaReq *preq, int op, int tag,
+	  uint64_t raddr, uint64_t laddr, size_t size,
+	  uint64_t sraddr, uint64_t sladdr, int flag)
+{
+    PrdmaTagPeer	*tp;
+    PrdmaPutQ		*pq;
+    int			nic = preq->fidx;
+    int			mtag, cc;
+
+    tp = &_prdmaTagPeer[preq->tslot];
+    preq->pend++;
+    if (tp->qhead[nic] == NULL && (mtag = _PrdmaTagTake(preq, tag)) >= 0) {
+	cc = _PrdmaPutIssue(preq, op, mtag, raddr, laddr, size,
+			    sraddr, sladdr, flag);
+	if (cc != 0) {
+	    _PrdmaTagFree(nic, mtag, preq->WPEER);
+	}
+	return cc;
+    }
+    if ((pq = _prdmaPutQfree) != NULL) {
+	_prdmaPutQfree = pq->next;
+    } else if ((pq = malloc(sizeof(PrdmaPutQ))) == NULL) {
+	preq->pend--;
+	return -1;
+    }
+    pq->next = NULL;
+    pq->preq = preq; pq->op = op; pq->tag = tag; pq->flag = flag;
+    pq->raddr = raddr; pq->laddr = laddr; pq->size = size;
+    pq->sraddr = sraddr; pq->sladdr = sladdr;
+    if (tp->qhead[nic] == NULL) {
+	tp->qhead[nic] = pq;
+    } else {
+	tp->qtail[nic]->next = pq;
+    }
+    tp->qtail[nic] = pq;
+    _prdmaWaitTag++;
+    return 0;
+}
+
+/* the tag is given back; the slot if a put is waiting for a tag, or -1 */
+static int
+_PrdmaTagRelease(int nic, int tag, int pid)
+{
+    PrdmaTagPeer	*tp;
+    PrdmaReq		*preq;
+    int			slot;
 
 #ifndef	notyet
     if ((nic < 0) || (nic >= PRDMA_NIC_NPAT)) {
@@ -1959,44 +3773,62 @@ _PrdmaTagFree(int nic, int tag, int pid)
 	PMPI_Abort(MPI_COMM_WORLD, -1);
     }
 #endif	/* notyet */
-    prev = &_prdmaTagTab[nic][tag /* ent */];
-    while ((preq = *prev) != 0) {
-	if (
-	    (preq->WPEER == pid)
-	    /* && (preq->fidx == nic) */
-	) {
-#ifdef	notyet
-	    found = prev;
-	    break;
-#else	/* notyet */
-	    if (found != 0) {
-		_PrdmaPrintf(stderr, "_PrdmaTagFree: duplicated\n");
-		PMPI_Abort(MPI_COMM_WORLD, -1);
-	    }
-	    found = prev;
-#endif	/* notyet */
-	}
-	prev = &preq->tnxt[tag]; /* tag next */
-    }
-    if (found != 0) {
-	preq = found[0];
-	found[0] = preq->tnxt[tag];
-	preq->tnxt[tag] = 0;
-	preq->pend--;
-    }
+    slot = (pid >= 0 && pid < _prdmaNprocs) ? _prdmaTagSlot[pid] : -1;
+    tp = (slot >= 0) ? &_prdmaTagPeer[slot] : NULL;
+    if (tp == NULL || (tp->free[nic] & (1U << tag)) != 0) {
 #ifndef	notyet
-    else {
 	_PrdmaPrintf(stderr, "_PrdmaTagFree: not found\n");
 	PMPI_Abort(MPI_COMM_WORLD, -1);
-    }
 #endif	/* notyet */
-    return ;
+	return -1;
+    }
+    preq = tp->req[nic][tag];
+    tp->req[nic][tag] = 0;
+    tp->free[nic] |= 1U << tag;
+    preq->pend--;
+    return (tp->qhead[nic] != NULL) ? slot : -1;
+}
+
+/* the queued puts in order, as long as tags are free */
+static void
+_PrdmaPutQDrain(int slot, int nic)
+{
+    PrdmaTagPeer	*tp = &_prdmaTagPeer[slot];
+    PrdmaReq		*preq;
+    PrdmaPutQ		*pq;
+    int			mtag;
+
+    while ((pq = tp->qhead[nic]) != NULL
+	   && (mtag = _PrdmaTagTake(pq->preq, pq->tag)) >= 0) {
+	tp->qhead[nic] = pq->next;
+	preq = pq->preq;
+	if (_PrdmaPutIssue(preq, pq->op, mtag, pq->raddr, pq->laddr,
+			   pq->size, pq->sraddr, pq->sladdr, pq->flag) != 0) {
+	    tp->req[nic][mtag] = 0;
+	    tp->free[nic] |= 1U << mtag;
+	    preq->pend--;
+	    _PrdmaPrintf(stderr, "FJMPI_Rdma_put error of a queued put\n");
+	    _PrdmaChangeState(preq, PRDMA_RSTATE_ERROR, -1);
+	}
+	pq->next = _prdmaPutQfree;
+	_prdmaPutQfree = pq;
+    }
+}
+
+static void
+_PrdmaTagFree(int nic, int tag, int pid)
+{
+    int		slot;
+
+    if ((slot = _PrdmaTagRelease(nic, tag, pid)) >= 0) {
+	_PrdmaPutQDrain(slot, nic);
+    }
 }
 
 static PrdmaReq	*
 _PrdmaTag2Req(int nic, int tag, int pid)
 {
-    PrdmaReq	*preq, **prev, *found = 0;
+    int		slot;
 
 #ifndef	notyet
     if ((nic < 0) || (nic >= PRDMA_NIC_NPAT)) {
@@ -2008,48 +3840,99 @@ _PrdmaTag2Req(int nic, int tag, int pid)
 	PMPI_Abort(MPI_COMM_WORLD, -1);
     }
 #endif	/* notyet */
-    prev = &_prdmaTagTab[nic][tag /* ent */];
-    while ((preq = *prev) != 0) {
-	if (
-	    (preq->WPEER == pid)
-	    /* && (preq->fidx == nic) */
-	) {
-#ifdef	notyet
-	    found = preq;
-	    break;
-#else	/* notyet */
-	    if (found != 0) {
-		_PrdmaPrintf(stderr, "_PrdmaTag2Req: duplicated, "
-		"tag %d nic %d, "
-		"%c for %d with nic %d, "
-		"%c for %d with nic %d "
-		"\n",
-		tag, nic,
-		(found->type == PRDMA_RTYPE_SEND)? 'S': 'R',
-			found->WPEER, found->fidx,
-		(preq->type == PRDMA_RTYPE_SEND)? 'S': 'R',
-			preq->WPEER, preq->fidx
-		);
-		PMPI_Abort(MPI_COMM_WORLD, -1);
-	    }
-	    found = preq;
+    slot = (pid >= 0 && pid < _prdmaNprocs) ? _prdmaTagSlot[pid] : -1;
+    if (slot < 0 || _prdmaTagPeer[slot].req[nic][tag] == 0) {
+#ifndef	notyet
+	_PrdmaPrintf(stderr, "_PrdmaTag2Req: not found\n");
 #endif	/* notyet */
+	return 0;
+    }
+    return _prdmaTagPeer[slot].req[nic][tag];
+}
+
+/*
+ * Tags of notified data (PRDMA_RNOTICE)
+ *   The last PRDMA_RNTAG_NUM tags are not used by _PrdmaTagTake(), so
+ *   that a remote notice of them is always the arrival of data.  The
+ *   receiver reserves one of them for the request per nic and peer,
+ *   and the sender puts the data with it.
+ */
+static PrdmaReq		*_prdmaRnTab[PRDMA_NIC_NPAT][PRDMA_TAG_MAX];
+
+/* receiver: a tag, or -1 if the remote notice is not used */
+static int
+_PrdmaRnTagGet(PrdmaReq *pr)
+{
+    PrdmaReq	*preq;
+    int		tag;
+
+    if (_prdmaRnotice == 0 || (pr->trans->flags & PRDMA_TRANS_F_RNOTICE) == 0
+	|| pr->size >= TOFU_MTU /* one fragment */) {
+	return -1;
+    }
+    for (tag = _prdmaTagNum; tag < PRDMA_TAG_MAX; tag++) {
+	for (preq = _prdmaRnTab[pr->fidx][tag]; preq; preq = preq->rnnxt) {
+	    if (preq->WPEER == pr->WPEER) break;
+	}
+	if (preq == 0) {
+	    pr->rnnxt = _prdmaRnTab[pr->fidx][tag];
+	    _prdmaRnTab[pr->fidx][tag] = pr;
+	    pr->rntag = tag;
+	    pr->rncnt = 0;
+	    return tag;
 	}
-	prev = &preq->tnxt[tag]; /* tag next */
     }
-#ifndef	notyet
-    if (found == 0) {
-	_PrdmaPrintf(stderr, "_PrdmaTag2Req: not found\n");
-	/* PMPI_Abort(MPI_COMM_WORLD, -1); */
+    /* SYNC_MARKER is used instead */
+    return -1;
+}
+
+static void
+_PrdmaRnTagFree(PrdmaReq *pr)
+{
+    PrdmaReq	**prev;
+
+    if (pr->rntag < 0) return;
+    for (prev = &_prdmaRnTab[pr->fidx][pr->rntag]; *prev;
+	 prev = &(*prev)->rnnxt) {
+	if (*prev == pr) {
+	    *prev = pr->rnnxt;
+	    break;
+	}
     }
-#endif	/* notyet */
-    return found;
+    pr->rnnxt = 0;
+    pr->rntag = -1;
+}
+
+static PrdmaReq *
+_PrdmaRnTag2Req(int nic, int tag, int pid)
+{
+    PrdmaReq	*preq;
+
+    for (preq = _prdmaRnTab[nic][tag]; preq; preq = preq->rnnxt) {
+	if (preq->WPEER == pid) {
+	    return preq;
+	}
+    }
+    return 0;
 }
 
 static void
 _PrdmaTagInit()
 {
-    memset(_prdmaTagTab, 0, sizeof(_prdmaTagTab));
+    int		i;
+
+    _prdmaTagSlot = malloc(sizeof(int)*_prdmaNprocs);
+    if (_prdmaTagSlot == NULL) {
+	_prdmaErrorExit(10);
+	return;
+    }
+    for (i = 0; i < _prdmaNprocs; i++) {
+	_prdmaTagSlot[i] = -1;
+    }
+    _prdmaTagNpeer = 0;
+    memset(_prdmaRnTab, 0, sizeof(_prdmaRnTab));
+    _prdmaTagNum = _prdmaRnotice ? (PRDMA_TAG_MAX - PRDMA_RNTAG_NUM)
+				 : PRDMA_TAG_MAX;
 }
 
 /*
@@ -2085,7 +3968,7 @@ typedef struct PrdmaTrace {
     unsigned short	 line;
     unsigned int	 done;
     int			 WPEER;
-    uint16_t		 uid;
+    uint32_t		 uid;
     char		 fidx_l;
     char		 fidx_r;
     uint16_t		 rsv16;
@@ -2286,3 +4169,1406 @@ _Prdma_Trc_Rst2Str(PrdmaTrace *trc, char *bp, size_t bz)
 }
 
 
+
+/*
+ * RDMA transports
+ *   _prdma_trans reaches every rank.  With PRDMA_HYBRID, the ranks
+ *   of this node are reached by _prdma_trans_local instead, so that
+ *   node-local messages do not go through the NIC.  A region is
+ *   registered to both of them.
+ */
+PrdmaTrans	*_prdma_trans = NULL;
+PrdmaTrans	*_prdma_trans_local = NULL;
+
+static PrdmaTrans *
+_PrdmaPeerTrans(int WPEER)
+{
+    if (_prdma_trans_local != NULL && _prdmaNodeRank[WPEER] >= 0) {
+	return _prdma_trans_local;
+    }
+    return _prdma_trans;
+}
+
+/*
+ * local notices of the transports that complete a put synchronously
+ */
+#define PRDMA_LCQSIZE	256	/* initial number of entries */
+
+typedef struct PrdmaLcq {
+    struct FJMPI_Rdma_cq *ent;
+    uint32_t		head;
+    uint32_t		tail;
+    uint32_t		size;
+} PrdmaLcq;
+
+#define PRDMA_NIC_MASK		(FJMPI_RDMA_NIC0 | FJMPI_RDMA_NIC1 \
+				 | FJMPI_RDMA_NIC2 | FJMPI_RDMA_NIC3)
+#define PRDMA_NIC_LMASK		(FJMPI_RDMA_LOCAL_NIC0 | FJMPI_RDMA_LOCAL_NIC1 \
+				 | FJMPI_RDMA_LOCAL_NIC2 | FJMPI_RDMA_LOCAL_NIC3)
+#define PRDMA_NIC_RMASK		(FJMPI_RDMA_REMOTE_NIC0 | FJMPI_RDMA_REMOTE_NIC1 \
+				 | FJMPI_RDMA_REMOTE_NIC2 | FJMPI_RDMA_REMOTE_NIC3)
+
+/* nic index of a put flag or of a poll_cq() argument */
+static int
+_PrdmaNicIdx(int val, int *tab, int mask)
+{
+    int		i;
+
+    for (i = 0; i < PRDMA_NIC_NPAT; i++) {
+	if ((val & mask) == tab[i]) return i;
+    }
+    return 0;
+}
+
+static void
+_PrdmaLcqPush(PrdmaLcq *q, int pid, int tag)
+{
+    struct FJMPI_Rdma_cq	*ent;
+    uint32_t			i, n;
+
+    if (q->tail - q->head >= q->size) {
+	n = (q->size == 0) ? PRDMA_LCQSIZE : q->size*2;
+	ent = malloc(sizeof(struct FJMPI_Rdma_cq)*n);
+	if (ent == NULL) {
+	    _prdmaErrorExit(3);
+	    return;
+	}
+	for (i = 0; q->head + i != q->tail; i++) {
+	    ent[i] = q->ent[(q->head + i) % q->size];
+	}
+	free(q->ent);
+	q->ent = ent;
+	q->head = 0;
+	q->tail = i;
+	q->size = n;
+    }
+    ent = &q->ent[q->tail % q->size];
+    ent->pid = pid;
+    ent->tag = tag;
+    q->tail++;
+}
+
+static int
+_PrdmaLcqPoll(PrdmaLcq *q, struct FJMPI_Rdma_cq *cq)
+{
+    if (q->head == q->tail) {
+	return 0;
+    }
+    *cq = q->ent[q->head % q->size];
+    q->head++;
+    return 1;
+}
+
+static void
+_PrdmaLcqFree(PrdmaLcq *q)
+{
+    free(q->ent);
+    memset(q, 0, sizeof(PrdmaLcq));
+}
+
+/*
+ * FJMPI_Rdma transport
+ */
+static int
+_PrdmaRdmaInit(void)
+{
+    return FJMPI_Rdma_init();
+}
+
+static int
+_PrdmaRdmaFini(void)
+{
+    return FJMPI_Rdma_finalize();
+}
+
+static uint64_t
+_PrdmaRdmaRegmem(int memid, void *addr, size_t size)
+{
+    return FJMPI_Rdma_reg_mem(memid, addr, size);
+}
+
+static int
+_PrdmaRdmaDeregmem(int memid)
+{
+    return FJMPI_Rdma_dereg_mem(memid);
+}
+
+static uint64_t
+_PrdmaRdmaRaddr(int pid, int memid)
+{
+    return FJMPI_Rdma_get_remote_addr(pid, memid);
+}
+
+static int
+_PrdmaRdmaPut(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	      size_t size, int flag)
+{
+    return FJMPI_Rdma_put(pid, tag, raddr, laddr, size, flag);
+}
+
+static int
+_PrdmaRdmaGet(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	      size_t size, int flag)
+{
+    return FJMPI_Rdma_get(pid, tag, raddr, laddr, size, flag);
+}
+
+static int
+_PrdmaRdmaPollcq(int nic, struct FJMPI_Rdma_cq *cq)
+{
+    return FJMPI_Rdma_poll_cq(nic, cq);
+}
+
+static PrdmaTrans	_prdmaTransRdma = {
+    "rdma",
+    _PrdmaRdmaInit, _PrdmaRdmaFini,
+    _PrdmaRdmaRegmem, _PrdmaRdmaDeregmem, _PrdmaRdmaRaddr,
+    _PrdmaRdmaPut, _PrdmaRdmaGet,
+#if defined(PRDMA_SHM_PUTF) && !defined(FJ_MPI)
+    _PrdmaShmPutf,	/* the emulation can fuse */
+#else
+    NULL,		/* FJMPI_Rdma_put has no ordered flag */
+#endif	/* PRDMA_SHM_PUTF && !FJ_MPI */
+    _PrdmaRdmaPollcq, NULL,
+#ifdef FJ_MPI
+    PRDMA_TRANS_F_RNOTICE
+#else
+    /* emulated by the node-local transport */
+    PRDMA_TRANS_F_RADDR | PRDMA_TRANS_F_RNOTICE
+#endif	/* FJ_MPI */
+};
+
+#if defined(MPI_VERSION) && (MPI_VERSION >= 3)
+/*
+ * MPI-3 one-sided transport
+ *   Registered regions are attached to a dynamic window and addressed
+ *   by their absolute address.  The regions of the registration cache
+ *   may overlap, e.g., a merged region and a region still referenced
+ *   inside, while attached memory may not: a region attaches only the
+ *   pieces of it not attached yet, and a piece is detached when the
+ *   last region on it is deregistered.  The address of each memid is
+ *   published in a directory window, so raddr() does not need the peer.
+ *   A put
+ *   is MPI_Put, or MPI_Accumulate(MPI_REPLACE) for a sync word
+ *   (PRDMA_PUT_SYNCWORD).  The operations are not flushed one by one:
+ *   flush() flushes all of them once, when a PRDMA call such as
+ *   MPI_Startall or MPI_Testall returns and before pollcq() hands out
+ *   the local notices queued so far, so that nothing a peer waits for
+ *   is held back while this rank computes.  A sync word is preceded by
+ *   a flush of its target only if data has been put there since, so
+ *   that the data is never seen after the sync marker.
+ */
+#define PRDMA_RMA_MEMID_MAX	(PRDMA_MEMID_MAX + 2)
+#define PRDMA_RMA_RADDR_TOUT	10	/* sec. to wait for a remote memid */
+
+static MPI_Comm		_prdmaRmaCom;
+static MPI_Win		_prdmaRmaWin;		/* registered regions */
+static MPI_Win		_prdmaRmaDirWin;	/* memid -> address */
+static uint64_t		*_prdmaRmaDir;
+static uint64_t		_prdmaRmaSize[PRDMA_RMA_MEMID_MAX];
+static int		_prdmaRmaSeparate;
+static PrdmaLcq		_prdmaRmaLcq[PRDMA_N_NICS];
+static unsigned		*_prdmaRmaDirty;	/* data put at this epoch */
+static unsigned		_prdmaRmaEpoch;		/* of the flushes */
+static int		_prdmaRmaNflush;	/* operations not flushed */
+
+typedef struct PrdmaRmaPiece {
+    struct PrdmaRmaPiece	*next;		/* by address */
+    uint64_t			lo, hi;
+    int				ref;		/* regions on it */
+} PrdmaRmaPiece;
+
+static PrdmaRmaPiece	*_prdmaRmaPiece;	/* attached */
+
+/* the regions on [lo, hi) are one fewer */
+static void
+_PrdmaRmaUnref(uint64_t lo, uint64_t hi)
+{
+    PrdmaRmaPiece	**pp, *rp;
+
+    for (pp = &_prdmaRmaPiece; (rp = *pp) != NULL && rp->lo < hi; ) {
+	if (rp->hi <= lo || --rp->ref > 0) {
+	    pp = &rp->next;
+	    continue;
+	}
+	MPI_Win_detach(_prdmaRmaWin, (void*)(unsigned long) rp->lo);
+	*pp = rp->next;
+	free(rp);
+    }
+}
+
+/* [lo, hi) is attached, in pieces; -1 if it cannot be */
+static int
+_PrdmaRmaRef(uint64_t lo, uint64_t hi)
+{
+    PrdmaRmaPiece	**pp, *rp;
+    uint64_t		pos = lo;
+
+    for (pp = &_prdmaRmaPiece; pos < hi; pp = &rp->next) {
+	rp = *pp;
+	if (rp != NULL && rp->hi <= pos) {
+	    continue;
+	}
+	if (rp == NULL || rp->lo > pos) {
+	    /* the gap up to the next piece */
+	    rp = malloc(sizeof(PrdmaRmaPiece));
+	    if (rp == NULL) {
+		_PrdmaRmaUnref(lo, pos);
+		return -1;
+	    }
+	    rp->next = *pp;
+	    rp->lo = pos;
+	    rp->hi = (rp->next == NULL || rp->next->lo > hi) ? hi
+		: rp->next->lo;
+	    rp->ref = 0;
+	    if (MPI_Win_attach(_prdmaRmaWin, (void*)(unsigned long) rp->lo,
+			       (MPI_Aint) (rp->hi - rp->lo)) != MPI_SUCCESS) {
+		free(rp);
+		_PrdmaRmaUnref(lo, pos);
+		return -1;
+	    }
+	    *pp = rp;
+	}
+	rp->ref++;
+	pos = rp->hi;
+    }
+    return 0;
+}
+
+static int
+_PrdmaRmaInit(void)
+{
+    int		*model, flag, np;
+
+    MPI_Comm_dup(MPI_COMM_WORLD, &_prdmaRmaCom);
+    MPI_Comm_size(_prdmaRmaCom, &np);
+    _prdmaRmaDirty = calloc(np, sizeof(unsigned));
+    _prdmaRmaEpoch = 1;
+    _prdmaRmaNflush = 0;
+    if (_prdmaRmaDirty == NULL) {
+	return FJMPI_RDMA_ERROR;
+    }
+    if (MPI_Win_create_dynamic(MPI_INFO_NULL, _prdmaRmaCom, &_prdmaRmaWin)
+	!= MPI_SUCCESS
+	|| MPI_Win_allocate(sizeof(uint64_t)*PRDMA_RMA_MEMID_MAX,
+			    sizeof(uint64_t), MPI_INFO_NULL, _prdmaRmaCom,
+			    &_prdmaRmaDir, &_prdmaRmaDirWin) != MPI_SUCCESS) {
+	return FJMPI_RDMA_ERROR;
+    }
+    memset(_prdmaRmaDir, 0, sizeof(uint64_t)*PRDMA_RMA_MEMID_MAX);
+    memset(_prdmaRmaSize, 0, sizeof(_prdmaRmaSize));
+    memset(_prdmaRmaLcq, 0, sizeof(_prdmaRmaLcq));
+    MPI_Win_get_attr(_prdmaRmaWin, MPI_WIN_MODEL, &model, &flag);
+    _prdmaRmaSeparate = (flag && *model == MPI_WIN_SEPARATE);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, _prdmaRmaWin);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, _prdmaRmaDirWin);
+    /* nobody may read a directory that is not cleared yet */
+    MPI_Barrier(_prdmaRmaCom);
+    return 0;
+}
+
+static int
+_PrdmaRmaFini(void)
+{
+    int		i;
+
+    MPI_Win_unlock_all(_prdmaRmaDirWin);
+    MPI_Win_unlock_all(_prdmaRmaWin);
+    for (i = 0; i < PRDMA_RMA_MEMID_MAX; i++) {
+	if (_prdmaRmaSize[i] > 0) {
+	    _PrdmaRmaUnref(_prdmaRmaDir[i], _prdmaRmaDir[i] + _prdmaRmaSize[i]);
+	    _prdmaRmaSize[i] = 0;
+	}
+    }
+    MPI_Win_free(&_prdmaRmaDirWin);
+    MPI_Win_free(&_prdmaRmaWin);
+    MPI_Comm_free(&_prdmaRmaCom);
+    for (i = 0; i < PRDMA_N_NICS; i++) {
+	_PrdmaLcqFree(&_prdmaRmaLcq[i]);
+    }
+    free(_prdmaRmaDirty);
+    _prdmaRmaDirty = NULL;
+    return 0;
+}
+
+static uint64_t
+_PrdmaRmaRegmem(int memid, void *addr, size_t size)
+{
+    MPI_Aint	disp;
+    uint64_t	start;
+
+    if (memid < 0 || memid >= PRDMA_RMA_MEMID_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    MPI_Get_address(addr, &disp);
+    start = (uint64_t) disp;
+    if (_prdmaRmaSize[memid] > 0) {
+	/* registered again without deregmem() */
+	_PrdmaRmaUnref(_prdmaRmaDir[memid],
+		       _prdmaRmaDir[memid] + _prdmaRmaSize[memid]);
+	_prdmaRmaSize[memid] = 0;
+    }
+    if (_PrdmaRmaRef(start, start + size) != 0) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaRmaSize[memid] = size;
+    _prdmaRmaDir[memid] = start;
+    MPI_Win_sync(_prdmaRmaDirWin);
+    return start;
+}
+
+static int
+_PrdmaRmaDeregmem(int memid)
+{
+    if (memid < 0 || memid >= PRDMA_RMA_MEMID_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    if (_prdmaRmaSize[memid] > 0) {
+	_PrdmaRmaUnref(_prdmaRmaDir[memid],
+		       _prdmaRmaDir[memid] + _prdmaRmaSize[memid]);
+    }
+    _prdmaRmaDir[memid] = 0;
+    _prdmaRmaSize[memid] = 0;
+    MPI_Win_sync(_prdmaRmaDirWin);
+    return 0;
+}
+
+static uint64_t
+_PrdmaRmaRaddr(int pid, int memid)
+{
+    uint64_t	addr;
+    time_t	t0;
+
+    if (memid < 0 || memid >= PRDMA_RMA_MEMID_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    /* the peer may not have registered it yet */
+    t0 = time(NULL);
+    for (;;) {
+	addr = 0;
+	MPI_Get(&addr, 1, MPI_UINT64_T, pid, memid, 1, MPI_UINT64_T,
+		_prdmaRmaDirWin);
+	MPI_Win_flush(pid, _prdmaRmaDirWin);
+	if (addr != 0) break;
+	if (time(NULL) - t0 > PRDMA_RMA_RADDR_TOUT) {
+	    _PrdmaPrintf(stderr, "prdma-rma: memid %d of rank %d "
+			 "is not registered\n", memid, pid);
+	    return FJMPI_RDMA_ERROR;
+	}
+    }
+    return addr;
+}
+
+static int
+_PrdmaRmaPut(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    int		cc = MPI_SUCCESS;
+
+    if (size > INT_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    if (flag & PRDMA_PUT_SYNCWORD) {
+	/* the target polls it, so it must be atomic, and after the data */
+	if (_prdmaRmaDirty[pid] == _prdmaRmaEpoch) {
+	    cc = MPI_Win_flush(pid, _prdmaRmaWin);
+	    _prdmaRmaDirty[pid] = 0;
+	}
+	if (cc == MPI_SUCCESS) {
+	    cc = MPI_Accumulate((void*)(unsigned long) laddr, 1, MPI_UINT32_T,
+				pid, (MPI_Aint) raddr, 1, MPI_UINT32_T,
+				MPI_REPLACE, _prdmaRmaWin);
+	}
+    } else {
+	cc = MPI_Put((void*)(unsigned long) laddr, (int) size, MPI_BYTE,
+		     pid, (MPI_Aint) raddr, (int) size, MPI_BYTE,
+		     _prdmaRmaWin);
+	_prdmaRmaDirty[pid] = _prdmaRmaEpoch;
+    }
+    if (cc != MPI_SUCCESS) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaRmaNflush++;
+    _PrdmaLcqPush(&_prdmaRmaLcq[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+					     PRDMA_NIC_LMASK)], pid, tag);
+    return 0;
+}
+
+static int
+_PrdmaRmaGet(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    int		cc;
+
+    if (size > INT_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    cc = MPI_Get((void*)(unsigned long) laddr, (int) size, MPI_BYTE,
+		 pid, (MPI_Aint) raddr, (int) size, MPI_BYTE, _prdmaRmaWin);
+    if (cc != MPI_SUCCESS) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaRmaNflush++;
+    _PrdmaLcqPush(&_prdmaRmaLcq[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+					     PRDMA_NIC_LMASK)], pid, tag);
+    return 0;
+}
+
+/* the flag is ordered after the data by the flush, and one notice */
+static int
+_PrdmaRmaPutf(int pid, int tag, uint64_t raddr, uint64_t laddr, size_t size,
+	      uint64_t fraddr, uint64_t fladdr, int flag)
+{
+    int		cc;
+
+    if (size > INT_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    cc = MPI_Put((void*)(unsigned long) laddr, (int) size, MPI_BYTE,
+		 pid, (MPI_Aint) raddr, (int) size, MPI_BYTE, _prdmaRmaWin);
+    if (cc == MPI_SUCCESS) {
+	cc = MPI_Win_flush(pid, _prdmaRmaWin);
+	_prdmaRmaDirty[pid] = 0;
+    }
+    if (cc == MPI_SUCCESS) {
+	cc = MPI_Accumulate((void*)(unsigned long) fladdr, 1, MPI_UINT32_T,
+			    pid, (MPI_Aint) fraddr, 1, MPI_UINT32_T,
+			    MPI_REPLACE, _prdmaRmaWin);
+    }
+    if (cc != MPI_SUCCESS) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaRmaNflush++;
+    _PrdmaLcqPush(&_prdmaRmaLcq[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+					     PRDMA_NIC_LMASK)], pid, tag);
+    return 0;
+}
+
+/* the operations issued so far, at the end of a PRDMA call as well */
+static int
+_PrdmaRmaFlush(void)
+{
+    int		np;
+
+    if (_prdmaRmaNflush == 0) {
+	return 0;
+    }
+    if (MPI_Win_flush_all(_prdmaRmaWin) != MPI_SUCCESS) {
+	_PrdmaPrintf(stderr, "rma: MPI_Win_flush_all failed\n");
+	MPI_Abort(MPI_COMM_WORLD, -1);
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaRmaNflush = 0;
+    if (++_prdmaRmaEpoch == 0) {
+	/* nothing is dirty after the flush */
+	MPI_Comm_size(_prdmaRmaCom, &np);
+	memset(_prdmaRmaDirty, 0, sizeof(unsigned)*np);
+	_prdmaRmaEpoch = 1;
+    }
+    return 0;
+}
+
+static int
+_PrdmaRmaPollcq(int nic, struct FJMPI_Rdma_cq *cq)
+{
+    int		flag;
+
+    /* the notices queued so far are of completed operations then */
+    _PrdmaRmaFlush();
+    if (_PrdmaLcqPoll(&_prdmaRmaLcq[_PrdmaNicIdx(nic, _prdmaNICID,
+						 PRDMA_NIC_MASK)], cq)) {
+	return FJMPI_RDMA_NOTICE;
+    }
+    /*
+     * Some one-sided implementations need the target to progress,
+     * and the separate memory model needs a sync to see remote puts.
+     */
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, _prdmaRmaCom, &flag,
+	       MPI_STATUS_IGNORE);
+    if (_prdmaRmaSeparate) {
+	MPI_Win_sync(_prdmaRmaWin);
+    }
+    return 0;
+}
+
+static PrdmaTrans	_prdmaTransRma = {
+    "rma",
+    _PrdmaRmaInit, _PrdmaRmaFini,
+    _PrdmaRmaRegmem, _PrdmaRmaDeregmem, _PrdmaRmaRaddr,
+    _PrdmaRmaPut, _PrdmaRmaGet, _PrdmaRmaPutf, _PrdmaRmaPollcq,
+    _PrdmaRmaFlush,
+    PRDMA_TRANS_F_RADDR | PRDMA_TRANS_F_PROGRESS | PRDMA_TRANS_F_SYNCWORD
+};
+#endif	/* MPI_VERSION >= 3 */
+
+static void
+_PrdmaTransinit(void)
+{
+    switch (_prdmaTransport) {
+#if defined(MPI_VERSION) && (MPI_VERSION >= 3)
+    case PRDMA_TRANS_RMA:
+	_prdma_trans = &_prdmaTransRma;
+	break;
+#endif	/* MPI_VERSION >= 3 */
+    case PRDMA_TRANS_RDMA:
+	_prdma_trans = &_prdmaTransRdma;
+	break;
+#ifdef PRDMA_USE_SHM
+    case PRDMA_TRANS_SIM:
+	_prdma_trans = &_prdmaTransSim;
+	break;
+#endif	/* PRDMA_USE_SHM */
+    default:
+	if (_prdmaMyrank == 0) {
+	    _PrdmaPrintf(stderr, "PRDMA_TRANSPORT %d is not supported\n",
+			 _prdmaTransport);
+	}
+	_prdma_trans = &_prdmaTransRdma;
+	break;
+    }
+    _prdma_trans->slot = 0;
+    _prdmaTransTab[0] = _prdma_trans;
+    _prdmaTransNum = 1;
+    _prdma_trans_local = NULL;
+#ifdef PRDMA_USE_SHM
+    if (_prdmaHybrid
+#ifndef FJ_MPI
+	/* FJMPI_Rdma_* are emulated by the same one */
+	&& _prdma_trans != &_prdmaTransRdma
+#endif	/* !FJ_MPI */
+	/* the simulated nodes are on this node */
+	&& _prdma_trans != &_prdmaTransSim
+	) {
+	_prdma_trans_local = &_prdmaTransShm;
+	_prdma_trans_local->slot = _prdmaTransNum;
+	_prdmaTransTab[_prdmaTransNum++] = _prdma_trans_local;
+    }
+#endif	/* PRDMA_USE_SHM */
+    if (_prdmaVerbose && _prdmaMyrank == 0) {
+	if (_prdma_trans_local != NULL) {
+	    _PrdmaPrintf(stderr, "Transport is %s (node-local: %s)\n",
+			 _prdma_trans->name, _prdma_trans_local->name);
+	} else {
+	    _PrdmaPrintf(stderr, "Transport is %s\n", _prdma_trans->name);
+	}
+    }
+}
+
+#ifdef PRDMA_USE_SHM
+/*
+ * Node-local transport
+ *   The control area of all local ranks (pid, memid directory and
+ *   remote completion queues) is a /dev/shm segment, and the data is
+ *   moved by Cross Memory Attach (process_vm_writev) directly into the
+ *   registered buffer of the peer, whose address is given by the
+ *   receiver in struct recvinfo.  Every put raises a FJMPI_RDMA_NOTICE
+ *   on the local NIC and a FJMPI_RDMA_REMOTE_NOTICE on the remote NIC
+ *   given in the flag, and a get (process_vm_readv) raises the local
+ *   one only.  It is the node-local transport of PRDMA_HYBRID,
+ *   and without the Fujitsu RDMA extension, FJMPI_Rdma_* are emulated
+ *   by it on a single Linux node.
+ */
+#define PRDMA_SHM_MEMID_MAX	512
+#define PRDMA_SHM_CQSIZE	1024	/* remote notices per nic */
+#define PRDMA_SHM_RADDR_TOUT	10	/* sec. to wait for a remote memid */
+
+typedef struct PrdmaShmCq {
+    volatile uint32_t	lock;
+    volatile uint32_t	head;
+    volatile uint32_t	tail;
+    uint32_t		overrun;
+    struct FJMPI_Rdma_cq ent[PRDMA_SHM_CQSIZE];
+} PrdmaShmCq;
+
+typedef struct PrdmaShmRank {
+    volatile pid_t	pid;
+    volatile uint64_t	self;		/* this entry in the rank */
+    volatile uint64_t	addr[PRDMA_SHM_MEMID_MAX];	/* 0: not registered */
+    PrdmaShmCq		rcq[PRDMA_N_NICS];		/* remote notices */
+} PrdmaShmRank;
+
+static PrdmaShmRank	*_prdmaShmSeg;
+static size_t		 _prdmaShmSegSize;
+static PrdmaShmRank	*_prdmaShmMe;
+static PrdmaLcq		 _prdmaShmLcq[PRDMA_N_NICS];
+static PrdmaLcq		 _prdmaShmPend[PRDMA_N_NICS];	/* remote notices */
+
+static PrdmaShmRank *
+_PrdmaShmPeer(int pid)
+{
+    if (pid < 0 || pid >= _prdmaNprocs || _prdmaNodeRank[pid] < 0) {
+	_PrdmaPrintf(stderr, "prdma-shm: rank %d is not on this node\n", pid);
+	return NULL;
+    }
+    return &_prdmaShmSeg[_prdmaNodeRank[pid]];
+}
+
+/* -1 if the queue is full */
+static int
+_PrdmaShmCqPush(PrdmaShmCq *q, int pid, int tag)
+{
+    struct FJMPI_Rdma_cq	*ent;
+    int				cc = 0;
+
+    while (__sync_lock_test_and_set(&q->lock, 1)) {
+	sched_yield();
+    }
+    if (q->tail - q->head >= PRDMA_SHM_CQSIZE) {
+	/* nobody is draining the queue */
+	q->overrun++;
+	cc = -1;
+    } else {
+	ent = &q->ent[q->tail % PRDMA_SHM_CQSIZE];
+	ent->pid = pid;
+	ent->tag = tag;
+	__sync_synchronize();
+	q->tail++;
+    }
+    __sync_lock_release(&q->lock);
+    return cc;
+}
+
+/*
+ * A remote notice is never lost since PRDMA_RNOTICE counts it.  If the
+ * queue of the peer is full, it is kept in the pending queue of the
+ * remote nic (pid is the peer) and pushed again by _PrdmaShmPollCq().
+ */
+static void
+_PrdmaShmRnotice(int nic, int pid, int tag)
+{
+    PrdmaShmRank	*rk;
+    PrdmaLcq		*pq = &_prdmaShmPend[nic];
+
+    if (pq->head == pq->tail) {
+	rk = &_prdmaShmSeg[_prdmaNodeRank[pid]];
+	if (_PrdmaShmCqPush(&rk->rcq[nic], _prdmaMyrank, tag) == 0) {
+	    return;
+	}
+    }
+    /* keep the order */
+    _PrdmaLcqPush(pq, pid, tag);
+}
+
+static void
+_PrdmaShmFlush(int nic)
+{
+    PrdmaShmRank		*rk;
+    PrdmaLcq			*pq = &_prdmaShmPend[nic];
+    struct FJMPI_Rdma_cq	*ent;
+
+    while (pq->head != pq->tail) {
+	ent = &pq->ent[pq->head % pq->size];
+	rk = &_prdmaShmSeg[_prdmaNodeRank[ent->pid]];
+	if (_PrdmaShmCqPush(&rk->rcq[nic], _prdmaMyrank, ent->tag) != 0) {
+	    break;
+	}
+	pq->head++;
+    }
+}
+
+/* Cross Memory Attach to the next local rank, agreed by all */
+static int
+_PrdmaShmProbe(PrdmaShmRank *rk)
+{
+    pid_t		pid;
+    struct iovec	liov, riov;
+    int			ok, all, nrank;
+
+    liov.iov_base = &pid;
+    liov.iov_len = sizeof(pid);
+    riov.iov_base = (void*)(unsigned long) (rk->self
+					    + offsetof(PrdmaShmRank, pid));
+    riov.iov_len = sizeof(pid);
+    ok = process_vm_readv(rk->pid, &liov, 1, &riov, 1, 0) == sizeof(pid)
+	&& pid == rk->pid;
+    if (!ok && _prdmaVerbose) {
+	_PrdmaPrintf(stderr, "prdma-shm: process_vm_readv from pid %d: %s\n",
+		     (int) rk->pid, strerror(errno));
+    }
+    MPI_Allreduce(&ok, &all, 1, MPI_INT, MPI_LAND, _prdmaNodeCom);
+    MPI_Comm_rank(_prdmaNodeCom, &nrank);
+    if (!all && nrank == 0) {
+	_PrdmaPrintf(stderr, "prdma-shm: Cross Memory Attach is not allowed, "
+		     "kernel.yama.ptrace_scope must be 0 "
+		     "(or PRDMA_PTRACER set)\n");
+    }
+    return all ? 0 : FJMPI_RDMA_ERROR;
+}
+
+static int
+_PrdmaShmInit(void)
+{
+    MPI_Comm	node = _prdmaNodeCom;
+    int		nrank, nsize;
+    char	name[64];
+    int		fd;
+
+    MPI_Comm_rank(node, &nrank);
+    MPI_Comm_size(node, &nsize);
+    /* the node leader creates the segment */
+    _prdmaShmSegSize = sizeof(PrdmaShmRank)*nsize;
+    fd = -1;
+    if (nrank == 0) {
+	snprintf(name, sizeof(name), "/dev/shm/prdma.%d.%ld",
+		 (int) getpid(), (long) time(NULL));
+	fd = open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd >= 0 && ftruncate(fd, _prdmaShmSegSize) != 0) {
+	    close(fd);
+	    unlink(name);
+	    fd = -1;
+	}
+	if (fd < 0) {
+	    name[0] = 0;
+	}
+    }
+    MPI_Bcast(name, sizeof(name), MPI_CHAR, 0, node);
+    if (name[0] == 0) {
+	_PrdmaPrintf(stderr, "prdma-shm: cannot create the segment\n");
+	return FJMPI_RDMA_ERROR;
+    }
+    if (nrank != 0) {
+	fd = open(name, O_RDWR);
+    }
+    _prdmaShmSeg = (fd < 0) ? MAP_FAILED
+	: mmap(NULL, _prdmaShmSegSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    MPI_Barrier(node);
+    if (nrank == 0) unlink(name);
+    if (_prdmaShmSeg == MAP_FAILED) {
+	_PrdmaPrintf(stderr, "prdma-shm: cannot map %s\n", name);
+	_prdmaShmSeg = NULL;
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaShmMe = &_prdmaShmSeg[nrank];
+    _prdmaShmMe->pid = getpid();
+    _prdmaShmMe->self = (uint64_t)(unsigned long) _prdmaShmMe;
+#ifdef PR_SET_PTRACER
+    /*
+     * Yama (kernel.yama.ptrace_scope=1) allows process_vm_writev() to
+     * the descendants only.  A process may name a single ptracer, and
+     * the local ranks write into each other, so any process of the user
+     * is let in only if PRDMA_PTRACER is set.
+     */
+    if (_prdmaPtracer) {
+	prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+    }
+#endif
+    memset(_prdmaShmLcq, 0, sizeof(_prdmaShmLcq));
+    memset(_prdmaShmPend, 0, sizeof(_prdmaShmPend));
+    MPI_Barrier(node);
+    if (nsize > 1) {
+	return _PrdmaShmProbe(&_prdmaShmSeg[(nrank + 1) % nsize]);
+    }
+    return 0;
+}
+
+static int
+_PrdmaShmFinalize(void)
+{
+    int		i;
+
+    if (_prdmaShmSeg == NULL) return 0;
+    if (_prdmaVerbose) {
+	for (i = 0; i < PRDMA_N_NICS; i++) {
+	    if (_prdmaShmMe->rcq[i].overrun) {
+		_PrdmaPrintf(stderr, "prdma-shm: nic %d deferred %u notices\n",
+			     i, _prdmaShmMe->rcq[i].overrun);
+	    }
+	}
+    }
+    for (i = 0; i < PRDMA_N_NICS; i++) {
+	_PrdmaLcqFree(&_prdmaShmLcq[i]);
+	_PrdmaLcqFree(&_prdmaShmPend[i]);
+    }
+    munmap((void*) _prdmaShmSeg, _prdmaShmSegSize);
+    _prdmaShmSeg = _prdmaShmMe = NULL;
+    return 0;
+}
+
+static uint64_t
+_PrdmaShmRegMem(int memid, void *buf, size_t size)
+{
+    if (memid < 0 || memid >= PRDMA_SHM_MEMID_MAX || buf == NULL) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaShmMe->addr[memid] = (uint64_t)(unsigned long) buf;
+    return (uint64_t)(unsigned long) buf;
+}
+
+static int
+_PrdmaShmDeregMem(int memid)
+{
+    if (memid < 0 || memid >= PRDMA_SHM_MEMID_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _prdmaShmMe->addr[memid] = 0;
+    return 0;
+}
+
+static uint64_t
+_PrdmaShmRemoteAddr(int pid, int memid)
+{
+    PrdmaShmRank	*rk;
+    uint64_t		addr;
+    time_t		t0;
+
+    if ((rk = _PrdmaShmPeer(pid)) == NULL
+	|| memid < 0 || memid >= PRDMA_SHM_MEMID_MAX) {
+	return FJMPI_RDMA_ERROR;
+    }
+    /* the peer may not have registered it yet */
+    t0 = time(NULL);
+    while ((addr = rk->addr[memid]) == 0) {
+	if (time(NULL) - t0 > PRDMA_SHM_RADDR_TOUT) {
+	    _PrdmaPrintf(stderr, "prdma-shm: memid %d of rank %d "
+			 "is not registered\n", memid, pid);
+	    return FJMPI_RDMA_ERROR;
+	}
+	sched_yield();
+    }
+    return addr;
+}
+
+/* copy between the local and the remote buffers */
+static int
+_PrdmaShmCopy(PrdmaShmRank *rk, int pid, uint64_t raddr, uint64_t laddr,
+	      size_t size, int get)
+{
+    struct iovec	liov, riov;
+    ssize_t		cc;
+
+    if (rk == _prdmaShmMe) {
+	if (get) {
+	    memcpy((void*)(unsigned long) laddr, (void*)(unsigned long) raddr,
+		   size);
+	} else {
+	    memcpy((void*)(unsigned long) raddr, (void*)(unsigned long) laddr,
+		   size);
+	}
+	return 0;
+    }
+    liov.iov_base = (void*)(unsigned long) laddr;
+    liov.iov_len = size;
+    riov.iov_base = (void*)(unsigned long) raddr;
+    riov.iov_len = size;
+    while (liov.iov_len > 0) {
+	cc = get ? process_vm_readv(rk->pid, &liov, 1, &riov, 1, 0)
+	    : process_vm_writev(rk->pid, &liov, 1, &riov, 1, 0);
+	if (cc < 0) {
+	    if (errno == EINTR) continue;
+	    _PrdmaPrintf(stderr, "prdma-shm: %s rank %d: %s\n",
+			 get ? "process_vm_readv from" : "process_vm_writev to",
+			 pid, strerror(errno));
+	    return FJMPI_RDMA_ERROR;
+	}
+	liov.iov_base = (char*) liov.iov_base + cc;
+	liov.iov_len -= cc;
+	riov.iov_base = (char*) riov.iov_base + cc;
+	riov.iov_len -= cc;
+    }
+    return 0;
+}
+
+static void
+_PrdmaShmNotice(PrdmaShmRank *rk, int pid, int tag, int flag)
+{
+    /* the data must be visible before the notices */
+    __sync_synchronize();
+    _PrdmaShmRnotice(_PrdmaNicIdx(flag, _prdmaDMAFlag_remote,
+				  PRDMA_NIC_RMASK), pid, tag);
+    _PrdmaLcqPush(&_prdmaShmLcq[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+					     PRDMA_NIC_LMASK)], pid, tag);
+}
+
+static int
+_PrdmaShmPut(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    PrdmaShmRank	*rk;
+
+    if ((rk = _PrdmaShmPeer(pid)) == NULL
+	|| _PrdmaShmCopy(rk, pid, raddr, laddr, size, 0) != 0) {
+	return FJMPI_RDMA_ERROR;
+    }
+    _PrdmaShmNotice(rk, pid, tag, flag);
+    return 0;
+}
+
+#ifdef PRDMA_SHM_PUTF
+/* the data and the flag word by one process_vm_writev() */
+static int
+_PrdmaShmPutf(int pid, int tag, uint64_t raddr, uint64_t laddr, size_t size,
+	      uint64_t fraddr, uint64_t fladdr, int flag)
+{
+    PrdmaShmRank	*rk;
+    struct iovec	liov[2], riov[2];
+    ssize_t		cc;
+
+    if ((rk = _PrdmaShmPeer(pid)) == NULL) {
+	return FJMPI_RDMA_ERROR;
+    }
+    if (rk == _prdmaShmMe) {
+	memcpy((void*)(unsigned long) raddr, (void*)(unsigned long) laddr,
+	       size);
+	__sync_synchronize();
+	*(volatile uint32_t*)(unsigned long) fraddr
+	    = *(uint32_t*)(unsigned long) fladdr;
+    } else {
+	liov[0].iov_base = (void*)(unsigned long) laddr;
+	liov[0].iov_len = size;
+	liov[1].iov_base = (void*)(unsigned long) fladdr;
+	liov[1].iov_len = sizeof(uint32_t);
+	riov[0].iov_base = (void*)(unsigned long) raddr;
+	riov[0].iov_len = size;
+	riov[1].iov_base = (void*)(unsigned long) fraddr;
+	riov[1].iov_len = sizeof(uint32_t);
+	do {
+	    cc = process_vm_writev(rk->pid, liov, 2, riov, 2, 0);
+	} while (cc < 0 && errno == EINTR);
+	if (cc < 0) {
+	    _PrdmaPrintf(stderr, "prdma-shm: process_vm_writev to rank %d: "
+			 "%s\n", pid, strerror(errno));
+	    return FJMPI_RDMA_ERROR;
+	}
+	if ((size_t) cc < size + sizeof(uint32_t)) {
+	    /* partially written, the rest in order */
+	    if (((size_t) cc < size
+		 && _PrdmaShmCopy(rk, pid, raddr + cc, laddr + cc,
+				  size - cc, 0) != 0)
+		|| _PrdmaShmCopy(rk, pid, fraddr, fladdr,
+				 sizeof(uint32_t), 0) != 0) {
+		return FJMPI_RDMA_ERROR;
+	    }
+	}
+    }
+    _PrdmaShmNotice(rk, pid, tag, flag);
+    return 0;
+}
+#endif	/* PRDMA_SHM_PUTF */
+
+static int
+_PrdmaShmGet(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    PrdmaShmRank	*rk;
+
+    if ((rk = _PrdmaShmPeer(pid)) == NULL
+	|| _PrdmaShmCopy(rk, pid, raddr, laddr, size, 1) != 0) {
+	return FJMPI_RDMA_ERROR;
+    }
+    __sync_synchronize();
+    _PrdmaLcqPush(&_prdmaShmLcq[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+					     PRDMA_NIC_LMASK)], pid, tag);
+    return 0;
+}
+
+static int
+_PrdmaShmPollCq(int nic, struct FJMPI_Rdma_cq *cq)
+{
+    PrdmaShmCq	*rq;
+    int		i;
+
+    i = _PrdmaNicIdx(nic, _prdmaNICID, PRDMA_NIC_MASK);
+    _PrdmaShmFlush(i);
+    if (_PrdmaLcqPoll(&_prdmaShmLcq[i], cq)) {
+	return FJMPI_RDMA_NOTICE;
+    }
+    rq = &_prdmaShmMe->rcq[i];
+    if (rq->head != rq->tail) {
+	__sync_synchronize();
+	*cq = rq->ent[rq->head % PRDMA_SHM_CQSIZE];
+	__sync_synchronize();
+	rq->head++;
+	return FJMPI_RDMA_REMOTE_NOTICE;
+    }
+    return 0;
+}
+
+static PrdmaTrans	_prdmaTransShm = {
+    "shm",
+    _PrdmaShmInit, _PrdmaShmFinalize,
+    _PrdmaShmRegMem, _PrdmaShmDeregMem, _PrdmaShmRemoteAddr,
+    _PrdmaShmPut, _PrdmaShmGet,
+#ifdef PRDMA_SHM_PUTF
+    _PrdmaShmPutf,
+#else
+    NULL,
+#endif	/* PRDMA_SHM_PUTF */
+    _PrdmaShmPollCq, NULL,
+    PRDMA_TRANS_F_RADDR | PRDMA_TRANS_F_RNOTICE
+};
+
+/*
+ * Simulated interconnect
+ *   An operation is carried out by the node-local transport when the
+ *   modeled interconnect has delivered it, so that the policies of
+ *   PRDMA can be compared on one Linux node with the timing of a real
+ *   machine.  The ranks are placed on the nodes of a 3-D torus.  An
+ *   operation starts when the previous one of the same NIC has been
+ *   injected (NIC bandwidth), and is delivered after the injection
+ *   latency and the latency of the hops to the peer.  Its notices are
+ *   raised the CQ delay later.  The operations are in order per NIC.
+ *   They are carried out by the issuing rank only, in its poll_cq()
+ *   and when its PRDMA calls return (flush()): an operation due while
+ *   the issuer computes lands at the next call of the issuer, not at
+ *   its due time, since the target has no access to the queue.  The
+ *   model is read from the file given by the PRDMA_SIMCONF environment
+ *   variable (see README).
+ */
+typedef struct PrdmaSimOp {
+    struct PrdmaSimOp	*next;
+    double		due;		/* delivered at */
+    int			landed;		/* data has been moved */
+    int			get;
+    int			pid;
+    int			tag;
+    int			flag;
+    uint64_t		raddr;
+    uint64_t		laddr;
+    size_t		size;
+    uint64_t		fraddr;		/* flag word of putf, or 0 */
+    uint64_t		fladdr;
+} PrdmaSimOp;
+
+typedef struct PrdmaSimNic {
+    PrdmaSimOp		*head;
+    PrdmaSimOp		*tail;
+    double		free;		/* injecting until */
+    double		last;		/* due of the last operation */
+    unsigned long	ops;
+    unsigned long	bytes;
+    double		busy;		/* time of injection */
+} PrdmaSimNic;
+
+static int		_prdmaSimTorus[3];
+static int		_prdmaSimPpn = 1;
+static double		_prdmaSimBandwidth = 5.0e9;	/* byte/sec */
+static double		_prdmaSimInjection = 1.0e-6;	/* sec */
+static double		_prdmaSimHop = 1.0e-7;
+static double		_prdmaSimCqDelay = 2.0e-7;
+static PrdmaSimNic	_prdmaSimNic[PRDMA_N_NICS];
+static PrdmaLcq		_prdmaSimLcq[PRDMA_N_NICS];
+
+static struct PrdmaSimParam {
+    char	*sym;
+    double	*var;
+} _prdmaSimParams[] = {
+    { "bandwidth", &_prdmaSimBandwidth },
+    { "injection", &_prdmaSimInjection },
+    { "hop", &_prdmaSimHop },
+    { "cq_delay", &_prdmaSimCqDelay },
+    { NULL, NULL }
+};
+
+static void
+_PrdmaSimConf(void)
+{
+    char	*path, *cp;
+    char	line[256], key[64];
+    FILE	*fp;
+    int		i, n, t[3];
+    double	v;
+
+    _prdmaSimTorus[0] = _prdmaNprocs;
+    _prdmaSimTorus[1] = _prdmaSimTorus[2] = 1;
+    if ((path = getenv("PRDMA_SIMCONF")) == NULL) {
+	return;
+    }
+    if ((fp = fopen(path, "r")) == NULL) {
+	_PrdmaPrintf(stderr, "prdma-sim: cannot open %s\n", path);
+	return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if ((cp = strchr(line, '#')) != NULL) {
+	    *cp = 0;
+	}
+	if (sscanf(line, "%63s", key) != 1) {
+	    continue;
+	}
+	if (!strcmp(key, "torus")) {
+	    t[0] = t[1] = t[2] = 1;
+	    n = sscanf(line, "%*s %d %d %d", &t[0], &t[1], &t[2]);
+	    for (i = 0; i < 3; i++) {
+		if (n >= 1 && t[i] > 0) _prdmaSimTorus[i] = t[i];
+	    }
+	    continue;
+	}
+	if (!strcmp(key, "procs_per_node")) {
+	    if (sscanf(line, "%*s %d", &n) == 1 && n > 0) _prdmaSimPpn = n;
+	    continue;
+	}
+	for (i = 0; _prdmaSimParams[i].sym != NULL; i++) {
+	    if (!strcmp(key, _prdmaSimParams[i].sym)) break;
+	}
+	if (_prdmaSimParams[i].sym == NULL
+	    || sscanf(line, "%*s %lf", &v) != 1 || v < 0.0
+	    || (_prdmaSimParams[i].var == &_prdmaSimBandwidth && v == 0.0)) {
+	    if (_prdmaMyrank == 0) {
+		_PrdmaPrintf(stderr, "prdma-sim: %s: bad line: %s", path, line);
+	    }
+	    continue;
+	}
+	*_prdmaSimParams[i].var = v;
+    }
+    fclose(fp);
+}
+
+/* hops between the nodes of this rank and pid */
+static int
+_PrdmaSimHops(int pid)
+{
+    int		a, b, d, i, hops = 0;
+
+    a = _prdmaMyrank / _prdmaSimPpn;
+    b = pid / _prdmaSimPpn;
+    for (i = 0; i < 3; i++) {
+	d = abs(a % _prdmaSimTorus[i] - b % _prdmaSimTorus[i]);
+	hops += (d < _prdmaSimTorus[i] - d) ? d : _prdmaSimTorus[i] - d;
+	a /= _prdmaSimTorus[i];
+	b /= _prdmaSimTorus[i];
+    }
+    return hops;
+}
+
+static int
+_PrdmaSimIssue(int get, int pid, int tag, uint64_t raddr, uint64_t laddr,
+	       size_t size, uint64_t fraddr, uint64_t fladdr, int flag)
+{
+    PrdmaSimNic	*nic;
+    PrdmaSimOp	*op;
+    double	now, start, xfer;
+
+    if (_PrdmaShmPeer(pid) == NULL) {
+	return FJMPI_RDMA_ERROR;
+    }
+    op = malloc(sizeof(PrdmaSimOp));
+    if (op == NULL) {
+	_prdmaErrorExit(3);
+	return FJMPI_RDMA_ERROR;
+    }
+    op->next = NULL;
+    op->landed = 0;
+    op->get = get;
+    op->pid = pid;
+    op->tag = tag;
+    op->flag = flag;
+    op->raddr = raddr;
+    op->laddr = laddr;
+    op->size = size;
+    op->fraddr = fraddr;
+    op->fladdr = fladdr;
+    if (fraddr != 0) {
+	size += sizeof(uint32_t);
+    }
+    nic = &_prdmaSimNic[_PrdmaNicIdx(flag, _prdmaDMAFlag_local,
+				     PRDMA_NIC_LMASK)];
+    now = MPI_Wtime();
+    start = (nic->free > now) ? nic->free : now;
+    xfer = (double) size/_prdmaSimBandwidth;
+    nic->free = start + xfer;
+    /* a get goes to the peer and back */
+    op->due = nic->free + _prdmaSimInjection
+	+ _prdmaSimHop*_PrdmaSimHops(pid)*(get ? 2 : 1);
+    if (op->due < nic->last) {
+	op->due = nic->last;
+    }
+    nic->last = op->due;
+    nic->ops++;
+    nic->bytes += size;
+    nic->busy += xfer;
+    if (nic->tail != NULL) {
+	nic->tail->next = op;
+    } else {
+	nic->head = op;
+    }
+    nic->tail = op;
+    return 0;
+}
+
+static void
+_PrdmaSimProgress(int i)
+{
+    PrdmaSimNic		*nic = &_prdmaSimNic[i];
+    PrdmaSimOp		*op;
+    PrdmaShmRank	*rk;
+    double		now;
+
+    if (nic->head == NULL) {
+	return;
+    }
+    now = MPI_Wtime();
+    for (op = nic->head; op != NULL && op->due <= now; op = op->next) {
+	if (op->landed) continue;
+	rk = _PrdmaShmPeer(op->pid);
+	if (_PrdmaShmCopy(rk, op->pid, op->raddr, op->laddr,
+			  op->size, op->get) != 0
+	    || (op->fraddr != 0
+		&& _PrdmaShmCopy(rk, op->pid, op->fraddr, op->fladdr,
+				 sizeof(uint32_t), 0) != 0)) {
+	    _PrdmaPrintf(stderr, "prdma-sim: operation to rank %d failed\n",
+			 op->pid);
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+	op->landed = 1;
+    }
+    while ((op = nic->head) != NULL && op->landed
+	   && op->due + _prdmaSimCqDelay <= now) {
+	/* the data must be visible before the notices */
+	__sync_synchronize();
+	if (!op->get) {
+	    _PrdmaShmRnotice(_PrdmaNicIdx(op->flag, _prdmaDMAFlag_remote,
+					  PRDMA_NIC_RMASK), op->pid, op->tag);
+	}
+	_PrdmaLcqPush(&_prdmaSimLcq[i], op->pid, op->tag);
+	if ((nic->head = op->next) == NULL) {
+	    nic->tail = NULL;
+	}
+	free(op);
+    }
+}
+
+/* the operations due by now, on every NIC */
+static int
+_PrdmaSimFlush(void)
+{
+    int		i;
+
+    for (i = 0; i < PRDMA_N_NICS; i++) {
+	_PrdmaSimProgress(i);
+    }
+    return 0;
+}
+
+static int
+_PrdmaSimInit(void)
+{
+    _PrdmaSimConf();
+    memset(_prdmaSimNic, 0, sizeof(_prdmaSimNic));
+    memset(_prdmaSimLcq, 0, sizeof(_prdmaSimLcq));
+    if (_prdmaVerbose && _prdmaMyrank == 0) {
+	_PrdmaPrintf(stderr, "prdma-sim: torus %dx%dx%d, %d procs/node, "
+		     "%g byte/sec, injection %g, hop %g, cq_delay %g sec\n",
+		     _prdmaSimTorus[0], _prdmaSimTorus[1], _prdmaSimTorus[2],
+		     _prdmaSimPpn, _prdmaSimBandwidth, _prdmaSimInjection,
+		     _prdmaSimHop, _prdmaSimCqDelay);
+    }
+    return _PrdmaShmInit();
+}
+
+static int
+_PrdmaSimFinalize(void)
+{
+    int		i;
+
+    for (i = 0; i < PRDMA_N_NICS; i++) {
+	/* the peers may wait for them */
+	while (_prdmaSimNic[i].head != NULL) {
+	    _PrdmaSimProgress(i);
+	}
+	if (_prdmaVerbose && _prdmaSimNic[i].ops > 0) {
+	    _PrdmaPrintf(stderr, "prdma-sim: nic %d: %lu ops, %lu bytes, "
+			 "busy %.6f sec\n", i, _prdmaSimNic[i].ops,
+			 _prdmaSimNic[i].bytes, _prdmaSimNic[i].busy);
+	}
+	_PrdmaLcqFree(&_prdmaSimLcq[i]);
+    }
+    return _PrdmaShmFinalize();
+}
+
+static int
+_PrdmaSimPut(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    return _PrdmaSimIssue(0, pid, tag, raddr, laddr, size, 0, 0, flag);
+}
+
+static int
+_PrdmaSimGet(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	     size_t size, int flag)
+{
+    return _PrdmaSimIssue(1, pid, tag, raddr, laddr, size, 0, 0, flag);
+}
+
+static int
+_PrdmaSimPutf(int pid, int tag, uint64_t raddr, uint64_t laddr, size_t size,
+	      uint64_t fraddr, uint64_t fladdr, int flag)
+{
+    return _PrdmaSimIssue(0, pid, tag, raddr, laddr, size,
+			  fraddr, fladdr, flag);
+}
+
+static int
+_PrdmaSimPollCq(int nic, struct FJMPI_Rdma_cq *cq)
+{
+    int		i;
+
+    i = _PrdmaNicIdx(nic, _prdmaNICID, PRDMA_NIC_MASK);
+    _PrdmaSimProgress(i);
+    if (_PrdmaLcqPoll(&_prdmaSimLcq[i], cq)) {
+	return FJMPI_RDMA_NOTICE;
+    }
+    /* remote notices */
+    return _PrdmaShmPollCq(nic, cq);
+}
+
+static PrdmaTrans	_prdmaTransSim = {
+    "sim",
+    _PrdmaSimInit, _PrdmaSimFinalize,
+    _PrdmaShmRegMem, _PrdmaShmDeregMem, _PrdmaShmRemoteAddr,
+    _PrdmaSimPut, _PrdmaSimGet, _PrdmaSimPutf,
+    _PrdmaSimPollCq, _PrdmaSimFlush,
+    PRDMA_TRANS_F_RADDR | PRDMA_TRANS_F_RNOTICE
+};
+
+#ifndef FJ_MPI
+int
+FJMPI_Rdma_init()
+{
+    return _PrdmaShmInit();
+}
+
+int
+FJMPI_Rdma_finalize()
+{
+    return _PrdmaShmFinalize();
+}
+
+uint64_t
+FJMPI_Rdma_reg_mem(int memid, void *buf, size_t size)
+{
+    return _PrdmaShmRegMem(memid, buf, size);
+}
+
+int
+FJMPI_Rdma_dereg_mem(int memid)
+{
+    return _PrdmaShmDeregMem(memid);
+}
+
+uint64_t
+FJMPI_Rdma_get_remote_addr(int pid, int memid)
+{
+    return _PrdmaShmRemoteAddr(pid, memid);
+}
+
+int
+FJMPI_Rdma_put(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	       size_t size, int flag)
+{
+    return _PrdmaShmPut(pid, tag, raddr, laddr, size, flag);
+}
+
+int
+FJMPI_Rdma_get(int pid, int tag, uint64_t raddr, uint64_t laddr,
+	       size_t size, int flag)
+{
+    return _PrdmaShmGet(pid, tag, raddr, laddr, size, flag);
+}
+
+int
+FJMPI_Rdma_poll_cq(int nic, struct FJMPI_Rdma_cq *cq)
+{
+    return _PrdmaShmPollCq(nic, cq);
+}
+#endif	/* !FJ_MPI */
+#endif	/* PRDMA_USE_SHM */
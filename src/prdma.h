@@ -9,21 +9,30 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <mpi.h>
 #ifdef FJ_MPI
 #include <mpi-ext.h>
 #else
+/*
+ * Without the Fujitsu extension, these are provided by the intra-node
+ * emulation in prdma.c (/dev/shm + Cross Memory Attach).
+ */
 struct FJMPI_Rdma_cq {
     int	pid;
     int	tag;
 };
-extern int	FJMPI_Rdma_reg_mem(int id, char *buf, int size);
+extern uint64_t	FJMPI_Rdma_reg_mem(int id, void *buf, size_t size);
+extern int	FJMPI_Rdma_dereg_mem(int id);
 extern int	FJMPI_Rdma_put(int dest, int tag,
-			       uint64_t laddr, uint64_t raddr,
-			       int size, int flag);
-extern int	FJMPI_Rdma_get_remote_addr(int, int);
+			       uint64_t raddr, uint64_t laddr,
+			       size_t size, int flag);
+extern int	FJMPI_Rdma_get(int dest, int tag,
+			       uint64_t raddr, uint64_t laddr,
+			       size_t size, int flag);
+extern uint64_t	FJMPI_Rdma_get_remote_addr(int, int);
 extern int	FJMPI_Rdma_init();
 extern int	FJMPI_Rdma_finalize();
 extern int	FJMPI_Rdma_poll_cq(int nic, struct FJMPI_Rdma_cq *cq);
@@ -48,6 +57,13 @@ extern int	FJMPI_Rdma_poll_cq(int nic, struct FJMPI_Rdma_cq *cq);
 #define FJMPI_RDMA_NIC3		0x008
 #endif
 
+/* MPI-3 added const to the send buffer arguments */
+#if defined(MPI_VERSION) && (MPI_VERSION >= 3)
+#define PRDMA_CONST	const
+#else
+#define PRDMA_CONST
+#endif
+
 typedef enum {
     PRDMA_RTYPE_SEND	= 1,
     PRDMA_RTYPE_RECV	= 2,
@@ -63,6 +79,7 @@ typedef enum {
     PRDMA_RSTATE_RECEIVER_SYNC_SENT = 7,
     PRDMA_RSTATE_DONE = 8,
     PRDMA_RSTATE_RESTART = 9,
+    PRDMA_RSTATE_RECEIVER_GOT_DATA = 10,
     PRDMA_RSTATE_ERROR = -1
     , PRDMA_RSTATE_UNKNOWN = -2
 } PrdmaRstate;
@@ -83,49 +100,100 @@ typedef struct PrdmaRst2Str {
     { PRDMA_RSTATE_RECEIVER_SYNC_SENT,	"SYNC_SENT"	}, \
     { PRDMA_RSTATE_DONE,		"DONE"		}, \
     { PRDMA_RSTATE_RESTART,		"RESTART"	}, \
+    { PRDMA_RSTATE_RECEIVER_GOT_DATA,	"GOT_DATA"	}, \
     { PRDMA_RSTATE_ERROR,		"ERROR"		}, \
     { PRDMA_RSTATE_UNKNOWN,		"unknown"	}, \
     { PRDMA_RSTATE_UNKNOWN,		0		}  \
 }
 
+#define PRDMA_TRANS_NSLOT	2	/* transports used at the same time */
+
 /* offset is memid */
 typedef struct PrdmaDmaRegion {
     void		*start;
-    uint64_t		dmaaddr;
+    uint64_t		dmaaddr[PRDMA_TRANS_NSLOT];	/* by trans slot */
     uint64_t		size;
     int			memid;
-    struct PrdmaDmaRegion *next;
+    int			ref;		/* requests on this region */
+    int			cached;		/* in the registration cache */
+    struct PrdmaDmaRegion *next, *prev;	/* LRU list of the cache */
 } PrdmaDmaRegion;
 
+/* sent by the receiver, and by the sender for the GET protocol */
 struct recvinfo {
+    uint64_t		_rbaddr;	/* DMA address of remote buf */
     int			_rbid;		/* memid of remote buf */
     int			_rsync;		/* index of synchronization */
+    int			_rsmemid;	/* memid of the segment of rsync */
+    int			_rsum;		/* group in the summary or -1 */
     int			_rfidx;		/* index of remote nic */
+    int			_rproto;	/* protocol chosen by the sender */
+    int			_rtag;		/* tag of the remote notice or -1 */
+    int			_rcredit;	/* depth of the ring of remote buf */
+    uint64_t		_rboff;		/* offset of remote buf in rbid */
 };
+#define rbaddr	rinfo._rbaddr
 #define rbid	rinfo._rbid
 #define rsync	rinfo._rsync
+#define rsmemid	rinfo._rsmemid
+#define rsum	rinfo._rsum
 #define rfidx	rinfo._rfidx
+#define rproto	rinfo._rproto
+#define rtag	rinfo._rtag
+#define rboff	rinfo._rboff
+#define rcredit	rinfo._rcredit
+/* data transfer protocol */
+#define PRDMA_PROTO_PUT		0	/* the sender puts the data */
+#define PRDMA_PROTO_GET		1	/* the receiver gets the data */
 /* tag for FJMPI_Rdma_put() */
 #define PRDMA_TAG_MAX		15
+#define PRDMA_RNTAG_NUM		7	/* tags of notified data (PRDMA_RNOTICE) */
 #define PRDMA_TAG_START		1
 
+/*
+ * The entries are grouped by use.  The first group, which fills the
+ * first cache line, is what the polling loops of MPI_Wait/Waitall,
+ * the synchronization and _PrdmaCQpoll() look at.  The second one is
+ * used when a message is sent, and the rest only at the initialization.
+ */
 typedef struct PrdmaReq {
-    struct PrdmaReq	*next;		/* link to the same hash key */
-    struct recvinfo	rinfo;
+    /* polling */
+    struct PrdmaReq	*trunks;	/* packetized */
+    PrdmaRstate		state;		/* state */
+    PrdmaRtype		type;		/* request type (send/recv) */
+    int			pend;
+    int			sndst;
     int			lsync;		/* index of synchronization */
+    unsigned int	done;
     uint32_t		transff;	/* flip/flop */
-    PrdmaRtype		type;		/* request type (send/recv) */
-    PrdmaRstate		state;		/* state */
-    uint16_t		uid;		/* uid of this request */
-    int			lbid;		/* memid of local buf */
+    int			proto;		/* PRDMA_PROTO_PUT or _GET */
+    int			credit;		/* depth of the ring, 0: flip/flop */
+    unsigned int	cseq;		/* iterations sent or consumed */
+    unsigned int	rncnt;		/* arrivals by the remote notice */
+    int			rntag;		/* tag of the remote notice or -1 */
+    int			flag;
+    uint32_t		uid;		/* handle: generation and slot */
+    /* sending */
+    struct PrdmaTrans	*trans;		/* transport to the remote rank */
     uint64_t		lbaddr;		/* local buf DMA address */
     uint64_t		raddr;		/* remote buf DMA address in sender
 					 * remote sync start address in recv */
-    MPI_Request		negreq;		/* for negotiation */
+    uint64_t		rsaddr;		/* DMA address of the remote sync */
+    uint64_t		rsumaddr;	/* and of the remote summary */
     size_t		size;		/* size in byte of this MPI message */
+    struct recvinfo	rinfo;
     int			WPEERW;		/* remote rank in MPI_COMM_WORLD */
+    int			fidx;
+    int			tslot;		/* slot of the peer in the tag table */
+    int			lbid;		/* memid of local buf */
+    int			csync;		/* sync entry holding cseq */
+    uint64_t		cbase;		/* DMA address of the ring */
     int			transcnt;	/* count in this message */
-    struct PrdmaReq	*trunks;	/* packetized */
+    /* initialization */
+    MPI_Request		negreq;		/* for negotiation */
+    struct PrdmaReq	*rnnxt;		/* remote notice tag next */
+    void		*cring;		/* ring of the receiver */
+    int			cmemid;		/* memid of the ring */
     /* The following entries are parameters of send/recv_init function */
     void		*buf;
     int			count;
@@ -134,25 +202,70 @@ typedef struct PrdmaReq {
     int			tag;
     MPI_Comm		comm;
     MPI_Request		*req;
-    int			fidx;
-    int			flag;
-    int			sndst;
-    struct PrdmaReq	*tnxt[PRDMA_TAG_MAX];	/* tag next */
-    int			pend;
-    unsigned int	done;
 } PrdmaReq;
 
+#define PRDMA_CACHELINE		64
+#define PRDMA_REQ_SIZE		\
+    ((sizeof(PrdmaReq) + PRDMA_CACHELINE - 1) & ~(PRDMA_CACHELINE - 1))
+/* i-th request structure of a block */
+#define PRDMA_REQ_AT(blk, i)	((PrdmaReq*) ((char*) (blk) + PRDMA_REQ_SIZE*(i)))
+#define PRDMA_SLAB_MAXN		8	/* longer blocks are not pooled */
+#define PRDMA_SLAB_NREQ		64	/* request structures in a slab */
+
 #define PRDMA_MEMID_MAX		510
 #define PRDMA_MEMID_SYNC	1
 #define PRDMA_MEMID_SCONST	2
 #define PRDMA_MEMID_START	3
 #define PRDMA_DMA_REGSSTART	(PRDMA_MEMID_SYNC + 1)
-#define PRDMA_DMA_HTABSIZE	512
 #define PRDMA_DMA_MAXSIZE	(16777216 - 4)	/* 2^24 - 4 */
 
-#define PRDMA_REQ_HTABSIZE	1024
-#define PRDMA_REQ_STARTUID	10  /* uid must exclude MPI_REQUEST_NULL */
-#define PRDMA_REQ_MAXREQ	1024
+/*
+ * Memory arenas of PrdmaAlloc() and MPI_Alloc_mem()
+ */
+#define PRDMA_HUGEPAGE		(2*1024*1024)
+#define PRDMA_ARENA_MAXSIZE	(PRDMA_DMA_MAXSIZE & ~(PRDMA_HUGEPAGE - 1))
+#define PRDMA_ARENA_ALIGN	64	/* and the size of a block header */
+
+typedef struct PrdmaArenaBlk {
+    size_t			size;	/* with the header */
+    struct PrdmaArenaBlk	*next;	/* free list in address order */
+} PrdmaArenaBlk;
+
+typedef struct PrdmaArena {
+    char		*base;
+    size_t		size;
+    int			memid;
+    PrdmaArenaBlk	*free;
+    struct PrdmaArena	*next;
+} PrdmaArena;
+
+/*
+ * A request handle (uid) is the slot of the request in the request
+ * table and the generation of the slot, which is advanced every time
+ * the slot is freed so that a stale handle is not taken for the new
+ * request.  The generation starts from 1 so that a handle never takes
+ * the small value of MPI_REQUEST_NULL.  A handle is odd and less than
+ * 2^29, and so is its Fortran handle, the handle plus 2^29
+ * (PRDMA_F_TO_C_OFFSET).  Neither can be taken for a request of the
+ * MPI library: the MPI_Request of Open MPI is an aligned pointer and
+ * its Fortran handle a small index, and a request handle of MPICH,
+ * in C and in Fortran, has either of the upper two bits set but for
+ * MPI_REQUEST_NULL, which is even.  _PrdmaReqFind() then confirms the
+ * slot and the generation of the handle in the request table.
+ * The table starts with PRDMA_REQ_INITSLOT slots and is doubled when
+ * all of them are used.
+ */
+#define PRDMA_REQ_SLOTBITS	20
+#define PRDMA_REQ_MAXSLOT	(1 << PRDMA_REQ_SLOTBITS)
+#define PRDMA_REQ_INITSLOT	1024
+#define PRDMA_REQ_IDBITS	29
+#define PRDMA_REQ_GENMAX	\
+    ((1 << (PRDMA_REQ_IDBITS - 1 - PRDMA_REQ_SLOTBITS)) - 1)
+#define PRDMA_REQ_HANDLE(slot, gen)	\
+    (((((gen) << PRDMA_REQ_SLOTBITS) | (slot)) << 1) | 1)
+#define PRDMA_REQ_SLOT(uid)	(((uid) >> 1) & (PRDMA_REQ_MAXSLOT - 1))
+#define PRDMA_REQ_ISHANDLE(id)	\
+    (((id) & 1) && (id) < (1 << PRDMA_REQ_IDBITS))
 #define PRDMA_SYNC_NOTUSED	0x00000000
 #define PRDMA_SYNC_USED		0x10000000
 #define PRDMA_SYNC_EVEN		0x00000000
@@ -164,6 +277,39 @@ typedef struct PrdmaReq {
 #define PRDMA_SYNC_CNSTFF_0	1
 #define PRDMA_SYNC_CNSTFF_1	2
 #define PRDMA_SYNC_CNSTSIZE	4
+/* iteration count of the credit protocol, PRDMA_SYNC_COUNT(0) is USED */
+#define PRDMA_SYNC_COUNT(n)	(PRDMA_SYNC_USED | ((n) & PRDMA_SYNC_IDXMASK))
+/* segments of the sync entries, an index is (segment, entry) */
+#define PRDMA_SYNC_SEGBITS	10
+#define PRDMA_SYNC_SEGSIZE	(1 << PRDMA_SYNC_SEGBITS)
+#define PRDMA_SYNC_MAXSEG	256
+#define PRDMA_SYNC_LINE		64	/* bytes of a cache line */
+#ifndef PRDMA_SYNC_STRIDE
+#define PRDMA_SYNC_STRIDE	16	/* words of an entry, 1: packed */
+#endif
+/* the summary has a word per group, each in a line of its own */
+#define PRDMA_SUMMARY_NGRP	16
+#define PRDMA_SUMMARY_GAP	\
+    ((PRDMA_SYNC_LINE/sizeof(uint32_t) + PRDMA_SYNC_STRIDE - 1)	\
+     / PRDMA_SYNC_STRIDE)
+#define PRDMA_SUMMARY_ENT(grp)	((grp)*PRDMA_SUMMARY_GAP)
+#define PRDMA_SUMMARY_GRP(idx)	((idx) % PRDMA_SUMMARY_NGRP)
+
+typedef struct PrdmaSyncSeg {
+    volatile uint32_t	*ent;
+    int			memid;
+    uint64_t		dmaaddr[PRDMA_TRANS_NSLOT];	/* by trans slot */
+} PrdmaSyncSeg;
+
+extern PrdmaSyncSeg	_prdmaSyncSeg[PRDMA_SYNC_MAXSEG];
+
+#define PRDMA_SYNC_SEG(idx)	(&_prdmaSyncSeg[(idx) >> PRDMA_SYNC_SEGBITS])
+#define PRDMA_SYNC_ENTRY(idx)	\
+    (PRDMA_SYNC_SEG(idx)->ent[((idx) & (PRDMA_SYNC_SEGSIZE - 1))	\
+			      * PRDMA_SYNC_STRIDE])
+#define PRDMA_SYNC_DMA(slot, idx)	\
+    (PRDMA_SYNC_SEG(idx)->dmaaddr[slot]	\
+     + ((idx) & (PRDMA_SYNC_SEGSIZE - 1))*PRDMA_SYNC_STRIDE*sizeof(uint32_t))
 
 #define PRDMA_FIND_ANY		1
 #define PRDMA_FIND_ALL		2
@@ -177,12 +323,6 @@ typedef struct PrdmaReq {
 #endif
 
 #define PRDMA_ROUND_INC(id, max) ( ((id + 1) == max) ? 0 : (id + 1))
-#define PRDMA_REQUID_INC				\
-{							\
-    ++_prdmaRequid;					\
-    if (_prdmaRequid == 0) _prdmaRequid = PRDMA_REQ_STARTUID; \
-}
-
 #define PRDMA_INIT					\
 {							\
     if (_prdmaInitialized == 0) _prdmaInit();		\
@@ -226,6 +366,52 @@ extern prdma_syn_cb_f	_prdma_syn_send;
 extern prdma_syn_wt_f	_prdma_syn_wait;
 
 
+/*
+ * RDMA transport
+ *   The FJMPI_Rdma interface of the Fujitsu extension, or the same
+ *   operations on top of other mechanisms.  Addresses are the values
+ *   returned by regmem() and raddr() of the same transport.
+ */
+#define PRDMA_TRANS_RDMA	0	/* FJMPI_Rdma_* (or its emulation) */
+#define PRDMA_TRANS_RMA		1	/* MPI-3 one-sided communication */
+#define PRDMA_TRANS_SIM		2	/* simulated interconnect (node-local) */
+
+typedef struct PrdmaTrans {
+    const char	*name;
+    int		(*init)(void);
+    int		(*fini)(void);
+    uint64_t	(*regmem)(int memid, void *addr, size_t size);
+    int		(*deregmem)(int memid);
+    uint64_t	(*raddr)(int pid, int memid);
+    int		(*put)(int pid, int tag, uint64_t raddr, uint64_t laddr,
+		       size_t size, int flag);
+    int		(*get)(int pid, int tag, uint64_t raddr, uint64_t laddr,
+		       size_t size, int flag);
+    /* put followed by a flag word, with one notice (or NULL) */
+    int		(*putf)(int pid, int tag, uint64_t raddr, uint64_t laddr,
+			size_t size, uint64_t fraddr, uint64_t fladdr,
+			int flag);
+    int		(*pollcq)(int nic, struct FJMPI_Rdma_cq *cq);
+    /* makes the operations issued so far visible (or NULL) */
+    int		(*flush)(void);
+    int		flags;
+    int		slot;		/* index of DMA addresses of a region */
+} PrdmaTrans;
+
+/* the address of regmem() is the one raddr() returns in the peer */
+#define PRDMA_TRANS_F_RADDR	0x1
+/* a put raises FJMPI_RDMA_REMOTE_NOTICE on the remote rank */
+#define PRDMA_TRANS_F_RNOTICE	0x2
+/* pollcq progresses the operations of the peers, even if idle here */
+#define PRDMA_TRANS_F_PROGRESS	0x4
+/* put() is told PRDMA_PUT_SYNCWORD in the flag for a sync word */
+#define PRDMA_TRANS_F_SYNCWORD	0x8
+#define PRDMA_PUT_SYNCWORD	0x10000000	/* the target polls the word */
+
+extern PrdmaTrans	*_prdma_trans;		/* to all the ranks */
+extern PrdmaTrans	*_prdma_trans_local;	/* to the node (or NULL) */
+
+
 /*
  * light-weight and high precision trace
  */
@@ -241,3 +427,23 @@ extern prdma_trc_cb_f	_prdma_trc_fini;
 extern prdma_trc_pt_f	_prdma_trc_wlog;
 extern prdma_trc_pt_f	_prdma_trc_rlog;
 
+
+/*
+ * Application interface
+ *	A schedule is a set of persistent requests compiled once, which
+ *	is started and waited on as a whole, in the order of MPI_Startall
+ *	and MPI_Waitall, without looking up the handles at every step.
+ *	The requests must not be freed before the schedule is.
+ *	PrdmaAlloc() returns memory registered in advance, which is given
+ *	back by PrdmaFree().
+ */
+typedef struct PrdmaSchedule	*PrdmaSchedule;
+
+extern int	PrdmaReserveRegion(void *addr, int size);
+extern void	*PrdmaAlloc(size_t size);
+extern void	PrdmaFree(void *ptr);
+extern int	PrdmaScheduleCreate(int count, MPI_Request *reqs,
+				    PrdmaSchedule *sched);
+extern int	PrdmaScheduleStart(PrdmaSchedule sched);
+extern int	PrdmaScheduleWait(PrdmaSchedule sched);
+extern int	PrdmaScheduleFree(PrdmaSchedule *sched);
@@ -0,0 +1,538 @@
+/*
+ * Benchmark of persistent communication
+ *   It covers the patterns of pobjtest1-5 and sweeps the message size:
+ *	pingpong	rank 0 <-> rank 1, half of the round trip
+ *	exchange	rank 2k <-> rank 2k+1 at the same time (pobjtest2)
+ *	multi		rank 0 -> rank 1 by -con connections (pobjtest3)
+ *	incast		all ranks -> rank 0 (pobjtest4)
+ *	startwait	rank 0 -> rank 1 by MPI_Start/MPI_Wait (pobjtest1,5)
+ *	schedule	exchange with a small header message of regular MPI,
+ *			by PrdmaScheduleStart/PrdmaScheduleWait in the
+ *			prdma build (BENCH_SCHEDULE), MPI_Startall/
+ *			MPI_Waitall otherwise
+ *   Each iteration is timed in rank 0 after -warmup iterations, and
+ *   min/p50/p99/max/mean latency and bandwidth are reported as CSV or
+ *   JSON.  The build column is "prdma" or "org" (see Makefile) so that
+ *   the outputs of both builds can be put side by side (run-bench.sh).
+ *   Before each iteration, the send buffers are filled with a pattern
+ *   of the iteration, the sender and the connection, which is checked
+ *   in the receive buffers after the iteration (out of the timing).
+ *   The exit status is 1 if some data is wrong.
+ *
+ * Usage:
+ *	prdma-bench [-pattern name|all] [-min byte] [-max byte]
+ *		    [-iter n] [-warmup n] [-con n] [-csv|-json] [-noheader]
+ */
+#include <mpi.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#ifdef BENCH_SCHEDULE
+#include "prdma.h"
+#endif
+
+#ifndef BENCH_BUILD
+#define BENCH_BUILD	"org"
+#endif
+#define OUT_CSV		0
+#define OUT_JSON	1
+#define HDR_SIZE	8	/* below PRDMA_RDMASIZE, a regular request */
+
+/* a buffer of a request, and the sender and the connection of its data */
+typedef struct Buffer {
+    char	*buf;
+    size_t	size;
+    int		rank;
+    int		con;
+} Buffer;
+
+typedef struct Pattern {
+    const char	*name;
+    /* the requests of this rank, returns the number of messages of rank 0 */
+    int		(*setup)(size_t size);
+    void	(*iterate)(void);
+} Pattern;
+
+int		nprocs, myrank;
+int		niter = 1000, nwarmup = 100, ncon = 4;
+size_t		minsize = 8, maxsize = 4*1024*1024, bufsize;
+int		output = OUT_CSV, header = 1, nrecords;
+char		**sbuf, **rbuf;
+int		nsbuf, nrbuf;
+MPI_Request	*req;
+MPI_Status	*stat;
+int		nreq;
+double		*samples;
+Buffer		*sends, *recvs;
+int		nsend, nrecv;
+int		step, nerrors;
+#ifdef BENCH_SCHEDULE
+PrdmaSchedule	sched;
+#endif
+
+void
+message(FILE *fp, const char *fmt, ...)
+{
+    va_list ap;
+    char buf[2048];
+
+    va_start(ap, fmt);
+    vsprintf(buf, fmt, ap);
+    va_end(ap);
+    fprintf(fp, "[%d]: %s", myrank, buf);
+    fflush(fp);
+}
+
+/*
+ * data check
+ */
+static void
+post_send(char *buf, size_t size, int con)
+{
+    sends[nsend].buf = buf;
+    sends[nsend].size = size;
+    sends[nsend].rank = myrank;
+    sends[nsend].con = con;
+    nsend++;
+}
+
+static void
+post_recv(char *buf, size_t size, int src, int con)
+{
+    recvs[nrecv].buf = buf;
+    recvs[nrecv].size = size;
+    recvs[nrecv].rank = src;
+    recvs[nrecv].con = con;
+    nrecv++;
+}
+
+static unsigned char
+seed(int iter, int rank, int con)
+{
+    return (unsigned char) (iter*131 + rank*17 + con*7 + 1);
+}
+
+static void
+fill(int iter)
+{
+    unsigned char	c;
+    size_t		j;
+    int			i;
+
+    for (i = 0; i < nsend; i++) {
+	c = seed(iter, sends[i].rank, sends[i].con);
+	for (j = 0; j < sends[i].size; j++) {
+	    sends[i].buf[j] = (char) (c + j);
+	}
+    }
+}
+
+static void
+check(Pattern *pat, int iter)
+{
+    unsigned char	c;
+    size_t		j;
+    int			i;
+
+    for (i = 0; i < nrecv; i++) {
+	c = seed(iter, recvs[i].rank, recvs[i].con);
+	for (j = 0; j < recvs[i].size; j++) {
+	    if (recvs[i].buf[j] != (char) (c + j)) break;
+	}
+	if (j < recvs[i].size) {
+	    if (nerrors++ < 10) {
+		message(stderr, "%s size %lu: data of rank %d (con %d) "
+			"wrong at byte %lu in iteration %d\n", pat->name,
+			(unsigned long) recvs[i].size, recvs[i].rank,
+			recvs[i].con,
+			(unsigned long) j, iter);
+	    }
+	}
+    }
+}
+
+/*
+ * patterns
+ */
+static int
+pingpong_setup(size_t size)
+{
+    if (myrank == 0) {
+	MPI_Recv_init(rbuf[0], size, MPI_BYTE, 1, 0, MPI_COMM_WORLD, &req[0]);
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, 1, 0, MPI_COMM_WORLD, &req[1]);
+	post_recv(rbuf[0], size, 1, 0);
+	post_send(sbuf[0], size, 0);
+	nreq = 2;
+    } else if (myrank == 1) {
+	MPI_Recv_init(rbuf[0], size, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &req[0]);
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &req[1]);
+	post_recv(rbuf[0], size, 0, 0);
+	post_send(sbuf[0], size, 0);
+	nreq = 2;
+    }
+    return 1;
+}
+
+static void
+pingpong_iterate()
+{
+    if (myrank == 0) {
+	MPI_Start(&req[0]);
+	MPI_Start(&req[1]);
+	MPI_Wait(&req[1], &stat[1]);
+	MPI_Wait(&req[0], &stat[0]);
+    } else if (myrank == 1) {
+	MPI_Start(&req[0]);
+	MPI_Wait(&req[0], &stat[0]);
+	MPI_Start(&req[1]);
+	MPI_Wait(&req[1], &stat[1]);
+    }
+}
+
+static int
+exchange_setup(size_t size)
+{
+    int		peer = myrank ^ 1;
+
+    if (peer < nprocs) {
+	MPI_Recv_init(rbuf[0], size, MPI_BYTE, peer, 0, MPI_COMM_WORLD,
+		      &req[0]);
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, peer, 0, MPI_COMM_WORLD,
+		      &req[1]);
+	post_recv(rbuf[0], size, peer, 0);
+	post_send(sbuf[0], size, 0);
+	nreq = 2;
+    }
+    return 2;
+}
+
+static int
+multi_setup(size_t size)
+{
+    int		i;
+
+    for (i = 0; i < ncon; i++) {
+	if (myrank == 0) {
+	    MPI_Send_init(sbuf[i], size, MPI_BYTE, 1, i, MPI_COMM_WORLD,
+			  &req[i]);
+	    post_send(sbuf[i], size, i);
+	} else if (myrank == 1) {
+	    MPI_Recv_init(rbuf[i], size, MPI_BYTE, 0, i, MPI_COMM_WORLD,
+			  &req[i]);
+	    post_recv(rbuf[i], size, 0, i);
+	}
+    }
+    if (myrank < 2) {
+	nreq = ncon;
+    }
+    return ncon;
+}
+
+static int
+incast_setup(size_t size)
+{
+    int		i;
+
+    if (myrank == 0) {
+	for (i = 1; i < nprocs; i++) {
+	    MPI_Recv_init(rbuf[i - 1], size, MPI_BYTE, i, 0,
+			  MPI_COMM_WORLD, &req[i - 1]);
+	    post_recv(rbuf[i - 1], size, i, 0);
+	}
+	nreq = nprocs - 1;
+    } else {
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &req[0]);
+	post_send(sbuf[0], size, 0);
+	nreq = 1;
+    }
+    return nprocs - 1;
+}
+
+static int
+startwait_setup(size_t size)
+{
+    if (myrank == 0) {
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, 1, 0, MPI_COMM_WORLD, &req[0]);
+	post_send(sbuf[0], size, 0);
+	nreq = 1;
+    } else if (myrank == 1) {
+	MPI_Recv_init(rbuf[0], size, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &req[0]);
+	post_recv(rbuf[0], size, 0, 0);
+	nreq = 1;
+    }
+    return 1;
+}
+
+static void
+startwait_iterate()
+{
+    if (nreq > 0) {
+	MPI_Start(&req[0]);
+	MPI_Wait(&req[0], &stat[0]);
+    }
+}
+
+/* Startall/Waitall of all the requests */
+static void
+all_iterate()
+{
+    if (nreq > 0) {
+	MPI_Startall(nreq, req);
+	MPI_Waitall(nreq, req, stat);
+    }
+}
+
+static int
+schedule_setup(size_t size)
+{
+    int		peer = myrank ^ 1;
+
+    if (peer < nprocs) {
+	MPI_Recv_init(rbuf[0], size, MPI_BYTE, peer, 0, MPI_COMM_WORLD,
+		      &req[0]);
+	MPI_Recv_init(rbuf[1], HDR_SIZE, MPI_BYTE, peer, 1, MPI_COMM_WORLD,
+		      &req[1]);
+	MPI_Send_init(sbuf[0], size, MPI_BYTE, peer, 0, MPI_COMM_WORLD,
+		      &req[2]);
+	MPI_Send_init(sbuf[1], HDR_SIZE, MPI_BYTE, peer, 1, MPI_COMM_WORLD,
+		      &req[3]);
+	post_recv(rbuf[0], size, peer, 0);
+	post_recv(rbuf[1], HDR_SIZE, peer, 1);
+	post_send(sbuf[0], size, 0);
+	post_send(sbuf[1], HDR_SIZE, 1);
+	nreq = 4;
+#ifdef BENCH_SCHEDULE
+	if (PrdmaScheduleCreate(nreq, req, &sched) != MPI_SUCCESS) {
+	    message(stderr, "Cannot create a schedule of %d requests\n", nreq);
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+#endif
+    }
+    return 2;
+}
+
+static void
+schedule_iterate()
+{
+#ifdef BENCH_SCHEDULE
+    if (nreq > 0) {
+	PrdmaScheduleStart(sched);
+	PrdmaScheduleWait(sched);
+    }
+#else
+    all_iterate();
+#endif
+}
+
+Pattern	patterns[] = {
+    { "pingpong", pingpong_setup, pingpong_iterate },
+    { "exchange", exchange_setup, all_iterate },
+    { "multi", multi_setup, all_iterate },
+    { "incast", incast_setup, all_iterate },
+    { "startwait", startwait_setup, startwait_iterate },
+    { "schedule", schedule_setup, schedule_iterate },
+    { NULL, NULL, NULL }
+};
+
+/*
+ * statistics
+ */
+static int
+dcompare(const void *a, const void *b)
+{
+    double	x = *(const double*) a, y = *(const double*) b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static void
+report(Pattern *pat, size_t size, int nmsg)
+{
+    double	min, p50, p99, max, mean, bw;
+    int		i;
+
+    qsort(samples, niter, sizeof(double), dcompare);
+    mean = 0.0;
+    for (i = 0; i < niter; i++) {
+	mean += samples[i];
+    }
+    mean /= (double) niter;
+    min = samples[0];
+    p50 = samples[niter/2];
+    p99 = samples[(int)((double) niter*0.99) < niter
+		  ? (int)((double) niter*0.99) : niter - 1];
+    max = samples[niter - 1];
+    bw = (mean > 0.0) ? (double) size*nmsg/mean/1.0e6 : 0.0;
+    if (output == OUT_CSV) {
+	if (header && nrecords == 0) {
+	    printf("build,pattern,procs,size,iter,"
+		   "min_us,p50_us,p99_us,max_us,mean_us,MBps\n");
+	}
+	printf("%s,%s,%d,%lu,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+	       BENCH_BUILD, pat->name, nprocs, (unsigned long) size, niter,
+	       min*1.0e6, p50*1.0e6, p99*1.0e6, max*1.0e6, mean*1.0e6, bw);
+    } else {
+	printf("%s{\"build\": \"%s\", \"pattern\": \"%s\", \"procs\": %d, "
+	       "\"size\": %lu, \"iter\": %d, \"min_us\": %.3f, "
+	       "\"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+	       "\"mean_us\": %.3f, \"MBps\": %.3f}",
+	       (nrecords == 0) ? "[\n" : ",\n",
+	       BENCH_BUILD, pat->name, nprocs, (unsigned long) size, niter,
+	       min*1.0e6, p50*1.0e6, p99*1.0e6, max*1.0e6, mean*1.0e6, bw);
+    }
+    fflush(stdout);
+    nrecords++;
+}
+
+static void
+run(Pattern *pat, size_t size)
+{
+    int		i, nmsg;
+    double	time0;
+
+    nreq = nsend = nrecv = 0;
+    nmsg = (*pat->setup)(size);
+    for (i = 0; i < nwarmup; i++) {
+	fill(step);
+	(*pat->iterate)();
+	check(pat, step++);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    for (i = 0; i < niter; i++) {
+	fill(step);
+	time0 = MPI_Wtime();
+	(*pat->iterate)();
+	samples[i] = MPI_Wtime() - time0;
+	check(pat, step++);
+    }
+    if (pat->iterate == pingpong_iterate) {
+	/* one way */
+	for (i = 0; i < niter; i++) {
+	    samples[i] /= 2.0;
+	}
+    }
+#ifdef BENCH_SCHEDULE
+    /* before its requests */
+    PrdmaScheduleFree(&sched);
+#endif
+    for (i = 0; i < nreq; i++) {
+	MPI_Request_free(&req[i]);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (myrank == 0) {
+	report(pat, size, nmsg);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    Pattern	*pat;
+    char	*pname = "all";
+    size_t	size;
+    int		i;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+
+    --argc, ++argv;
+    while (argc > 0) {
+	if (strcmp(argv[0], "-pattern") == 0 && argc > 1) {
+	    pname = argv[1];
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-min") == 0 && argc > 1) {
+	    minsize = atol(argv[1]);
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-max") == 0 && argc > 1) {
+	    maxsize = atol(argv[1]);
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-iter") == 0 && argc > 1) {
+	    niter = atoi(argv[1]);
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-warmup") == 0 && argc > 1) {
+	    nwarmup = atoi(argv[1]);
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-con") == 0 && argc > 1) {
+	    ncon = atoi(argv[1]);
+	    argc -= 2; argv += 2;
+	} else if (strcmp(argv[0], "-csv") == 0) {
+	    output = OUT_CSV;
+	    argc -= 1; argv += 1;
+	} else if (strcmp(argv[0], "-json") == 0) {
+	    output = OUT_JSON;
+	    argc -= 1; argv += 1;
+	} else if (strcmp(argv[0], "-noheader") == 0) {
+	    header = 0;
+	    argc -= 1; argv += 1;
+	} else {
+	    if (myrank == 0) {
+		message(stderr, "Unknown option %s\n", argv[0]);
+	    }
+	    MPI_Abort(MPI_COMM_WORLD, -1);
+	}
+    }
+    if (nprocs < 2) {
+	message(stderr, "At least two processes are needed\n");
+	MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    if (ncon < 1) ncon = 1;
+    if (niter < 1) niter = 1;
+    if (minsize < 1) minsize = 1;
+    bufsize = (maxsize > HDR_SIZE) ? maxsize : HDR_SIZE;
+    /* buffers of the connections, and of the senders of incast in rank 0 */
+    nsbuf = (ncon > 2) ? ncon : 2;	/* the header of schedule */
+    nrbuf = (myrank == 0 && nprocs - 1 > nsbuf) ? nprocs - 1 : nsbuf;
+    sbuf = malloc(sizeof(char*)*nsbuf);
+    rbuf = malloc(sizeof(char*)*nrbuf);
+    for (i = 0; sbuf && rbuf && i < nrbuf; i++) {
+	if (i < nsbuf && (sbuf[i] = malloc(bufsize)) != 0) {
+	    memset(sbuf[i], myrank + 1, bufsize);
+	}
+	if ((rbuf[i] = malloc(bufsize)) != 0) {
+	    memset(rbuf[i], 0, bufsize);
+	}
+	if ((i < nsbuf && sbuf[i] == 0) || rbuf[i] == 0) break;
+    }
+    if (sbuf == 0 || rbuf == 0 || i < nrbuf) {
+	message(stderr, "Cannot allocate data whose size is %lu\n",
+		(unsigned long) maxsize);
+	MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    i = (nprocs > nsbuf) ? nprocs : nsbuf;
+    i = (i > 4) ? i : 4;	/* requests of schedule */
+    req = malloc(sizeof(MPI_Request)*i);
+    stat = malloc(sizeof(MPI_Status)*i);
+    sends = malloc(sizeof(Buffer)*i);
+    recvs = malloc(sizeof(Buffer)*i);
+    samples = malloc(sizeof(double)*niter);
+    if (req == 0 || stat == 0 || sends == 0 || recvs == 0 || samples == 0) {
+	message(stderr, "Cannot allocate %d samples\n", niter);
+	MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+
+    for (pat = patterns; pat->name != NULL; pat++) {
+	if (strcmp(pname, "all") != 0 && strcmp(pname, pat->name) != 0) {
+	    continue;
+	}
+	for (size = minsize; size <= maxsize; size *= 2) {
+	    run(pat, size);
+	}
+    }
+    if (myrank == 0) {
+	if (nrecords == 0) {
+	    message(stderr, "Unknown pattern %s\n", pname);
+	} else if (output == OUT_JSON) {
+	    printf("\n]\n");
+	}
+    }
+    i = nerrors;
+    MPI_Allreduce(&i, &nerrors, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if (myrank == 0 && nerrors > 0) {
+	message(stderr, "%d receive buffers have wrong data\n", nerrors);
+    }
+    MPI_Finalize();
+    return (nerrors > 0) ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#! /bin/bash -x
+#PJM --rsc-list "node=1x2"
+#PJM --rsc-list "elapse=00:30:00"
+#PJM --rsc-list "node-mem=10Gi"
+#PJM -s
+#
+# prdma-bench of both builds, e.g.,
+#	./run-bench.sh -pattern pingpong -max 1048576
+# bench.csv has the rows of both builds, and the p50 latencies are
+# shown side by side.
+source /etc/profile.d/modules.sh
+export PARALLEL=16
+export OMP_NUM_THREADS=$PARALLEL
+export fu08bf=1
+MPIEXEC=${MPIEXEC:-mpiexec}
+OUT=${OUT:-bench.csv}
+
+$MPIEXEC ./prdma-bench-prdma -csv "$@" > $OUT
+$MPIEXEC ./prdma-bench-org -csv -noheader "$@" >> $OUT
+set +x
+echo "pattern size p50_us(prdma) p50_us(org) org/prdma"
+awk -F, 'NR > 1 {
+	key = $2 " " $4
+	if (!(key in seen)) { seen[key] = 1; keys[n++] = key }
+	p50[$1, key] = $7
+}
+END {
+	for (i = 0; i < n; i++) {
+		k = keys[i]; p = p50["prdma", k]; o = p50["org", k]
+		printf "%s %s %s %.3g\n", k, p, o, (p > 0) ? o/p : 0
+	}
+}' $OUT